@@ -0,0 +1,63 @@
+#include "predict_batch.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace rime {
+
+namespace predict {
+
+static void PredictRange(PredictDb* db,
+                         const vector<string>& queries,
+                         const BatchOptions& options,
+                         size_t begin,
+                         size_t end,
+                         vector<vector<string>>* results) {
+  vector<predict::CandidateList> found;
+  if (!options.backoff) {
+    vector<std::string_view> keys(queries.begin() + begin,
+                                  queries.begin() + end);
+    found = db->LookupBatch(keys);
+  }
+  marisa::Agent agent;
+  for (size_t i = begin; i < end; ++i) {
+    auto candidates = options.backoff ? db->LookupBackoff(queries[i])
+                                      : found[i - begin];
+    auto& texts = (*results)[i];
+    for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+      if (options.top_k > 0 && texts.size() >= options.top_k)
+        break;
+      auto text = db->GetText(it.string_id(), &agent);
+      texts.emplace_back(text.data(), text.size());
+    }
+  }
+}
+
+vector<vector<string>> PredictBatch(PredictDb* db,
+                                    const vector<string>& queries,
+                                    const BatchOptions& options) {
+  vector<vector<string>> results(queries.size());
+  size_t num_threads = options.num_threads > 0
+                           ? size_t(options.num_threads)
+                           : size_t(std::thread::hardware_concurrency());
+  num_threads = (std::max)(num_threads, size_t(1));
+  num_threads = (std::min)(num_threads, (std::max)(queries.size(), size_t(1)));
+  // each thread takes a contiguous range, writing its own results
+  size_t range = (queries.size() + num_threads - 1) / num_threads;
+  vector<std::thread> threads;
+  for (size_t begin = range; begin < queries.size(); begin += range) {
+    size_t end = (std::min)(begin + range, queries.size());
+    threads.emplace_back(PredictRange, db, std::cref(queries),
+                         std::cref(options), begin, end, &results);
+  }
+  PredictRange(db, queries, options, 0, (std::min)(range, queries.size()),
+               &results);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return results;
+}
+
+}  // namespace predict
+
+}  // namespace rime
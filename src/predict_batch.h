@@ -0,0 +1,26 @@
+#ifndef RIME_PREDICT_BATCH_H_
+#define RIME_PREDICT_BATCH_H_
+
+#include "predict_db.h"
+
+namespace rime {
+
+namespace predict {
+
+struct BatchOptions {
+  size_t top_k = 5;      // candidates to return per query, 0 for all
+  bool backoff = false;  // look up the longest known context of a query
+  int num_threads = 0;   // 0 to use all cores
+};
+
+// predicts the top candidates of each query, a db key as made by
+// ContextKey(), looking them up in parallel in the read-only db.
+vector<vector<string>> PredictBatch(PredictDb* db,
+                                    const vector<string>& queries,
+                                    const BatchOptions& options);
+
+}  // namespace predict
+
+}  // namespace rime
+
+#endif  // RIME_PREDICT_BATCH_H_
@@ -0,0 +1,105 @@
+#include "predict_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace rime {
+
+namespace predict {
+
+// payload layout: text count, text lengths, float weights, the count of
+// candidates following and their float total weight, then the texts back
+// to back.
+static constexpr size_t kWeightsOffset = 1 + ResultCache::kMaxTexts;
+static constexpr size_t kMoreOffset =
+    kWeightsOffset + ResultCache::kMaxTexts * sizeof(float);
+static constexpr size_t kTotalWeightOffset = kMoreOffset + sizeof(uint32_t);
+static constexpr size_t kHeaderSize = kTotalWeightOffset + sizeof(float);
+
+bool ResultCache::Get(uint64_t hash,
+                      uint32_t version,
+                      vector<string>* texts,
+                      vector<float>* weights,
+                      uint32_t* more,
+                      double* total_weight) const {
+  const Slot& slot = slots_[hash % kNumSlots];
+  uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if (sequence & 1)
+    return false;
+  if (slot.version.load(std::memory_order_relaxed) != version ||
+      slot.hash.load(std::memory_order_relaxed) != hash)
+    return false;
+  uint64_t words[kNumWords];
+  for (size_t i = 0; i < kNumWords; ++i) {
+    words[i] = slot.payload[i].load(std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+    return false;
+  const auto* payload = reinterpret_cast<const uint8_t*>(words);
+  size_t count = (std::min)(size_t(payload[0]), kMaxTexts);
+  const char* text = reinterpret_cast<const char*>(payload + kHeaderSize);
+  const char* end = reinterpret_cast<const char*>(payload + kPayloadSize);
+  texts->clear();
+  weights->resize(count);
+  if (count > 0)
+    std::memcpy(weights->data(), payload + kWeightsOffset,
+                count * sizeof(float));
+  std::memcpy(more, payload + kMoreOffset, sizeof(uint32_t));
+  float total = 0.f;
+  std::memcpy(&total, payload + kTotalWeightOffset, sizeof(float));
+  *total_weight = total;
+  for (size_t i = 0; i < count; ++i) {
+    size_t length = payload[1 + i];
+    if (text + length > end)
+      return false;
+    texts->emplace_back(text, length);
+    text += length;
+  }
+  return true;
+}
+
+void ResultCache::Put(uint64_t hash,
+                      uint32_t version,
+                      const vector<string>& texts,
+                      const vector<float>& weights,
+                      uint32_t more,
+                      double total_weight) {
+  uint64_t words[kNumWords] = {};
+  auto* payload = reinterpret_cast<uint8_t*>(words);
+  if (texts.size() > kMaxTexts || weights.size() != texts.size())
+    return;
+  payload[0] = uint8_t(texts.size());
+  if (!weights.empty())
+    std::memcpy(payload + kWeightsOffset, weights.data(),
+                weights.size() * sizeof(float));
+  std::memcpy(payload + kMoreOffset, &more, sizeof(uint32_t));
+  float total = float(total_weight);
+  std::memcpy(payload + kTotalWeightOffset, &total, sizeof(float));
+  size_t offset = kHeaderSize;
+  for (size_t i = 0; i < texts.size(); ++i) {
+    const string& text = texts[i];
+    if (text.length() > 255 || offset + text.length() > kPayloadSize)
+      return;
+    payload[1 + i] = uint8_t(text.length());
+    std::memcpy(payload + offset, text.data(), text.length());
+    offset += text.length();
+  }
+  Slot& slot = slots_[hash % kNumSlots];
+  uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  if ((sequence & 1) ||
+      !slot.sequence.compare_exchange_strong(sequence, sequence + 1,
+                                             std::memory_order_acquire))
+    return;
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.version.store(version, std::memory_order_relaxed);
+  slot.hash.store(hash, std::memory_order_relaxed);
+  for (size_t i = 0; i < kNumWords; ++i) {
+    slot.payload[i].store(words[i], std::memory_order_relaxed);
+  }
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+}  // namespace predict
+
+}  // namespace rime
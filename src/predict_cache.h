@@ -0,0 +1,57 @@
+#ifndef RIME_PREDICT_CACHE_H_
+#define RIME_PREDICT_CACHE_H_
+
+#include <atomic>
+#include <string_view>
+#include <rime/common.h>
+
+namespace rime {
+
+namespace predict {
+
+// a fixed-size cache of the decoded top candidates of recent queries,
+// shared by sessions without locking.
+// each slot is a seqlock: a reader misses rather than waits while the slot
+// is being written, and a writer gives up if another one is at it.
+class ResultCache {
+ public:
+  static constexpr size_t kNumSlots = 256;
+  static constexpr size_t kMaxTexts = 8;
+  // count, lengths, weights and texts
+  static constexpr size_t kPayloadSize = 256;
+
+  // finds the texts, and their normalized weights, cached for a query hash
+  // in the given db version; an empty result is also cached. more is the
+  // number of candidates shown after the texts, normalized by total_weight.
+  bool Get(uint64_t hash,
+           uint32_t version,
+           vector<string>* texts,
+           vector<float>* weights,
+           uint32_t* more,
+           double* total_weight) const;
+  // caches the texts unless they are too many or too long.
+  void Put(uint64_t hash,
+           uint32_t version,
+           const vector<string>& texts,
+           const vector<float>& weights,
+           uint32_t more,
+           double total_weight);
+
+ private:
+  static constexpr size_t kNumWords = kPayloadSize / sizeof(uint64_t);
+
+  struct Slot {
+    std::atomic<uint32_t> sequence{0};  // odd while being written
+    std::atomic<uint32_t> version{0};   // 0 for an empty slot
+    std::atomic<uint64_t> hash{0};
+    std::atomic<uint64_t> payload[kNumWords] = {};
+  };
+
+  Slot slots_[kNumSlots];
+};
+
+}  // namespace predict
+
+}  // namespace rime
+
+#endif  // RIME_PREDICT_CACHE_H_
@@ -1,22 +1,298 @@
 #include "predict_db.h"
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_set>
 #include <boost/algorithm/string.hpp>
-#include <darts.h>
+#include <boost/crc.hpp>
 #include <rime/resource.h>
 #include <rime/dict/mapped_file.h>
 #include <rime/dict/string_table.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace rime {
 
-const string kPredictFormat = "Rime::Predict/1.0";
+const string kPredictFormat = "Rime::Predict/1.2";
+const string kPredictCompactFormat = "Rime::Predict/2.0";
+// with marisa tries
+const string kPredictMarisaFormat = "Rime::Predict/1.3";
+const string kPredictCompactMarisaFormat = "Rime::Predict/2.1";
 const string kPredictFormatPrefix = "Rime::Predict/";
 
+// separates the query from the code prefix in a filter key; not a
+// character of any query.
+constexpr char kFilterDelimiter = '\x01';
+
+static void AppendVarint(uint32_t value, string* out) {
+  while (value >= 0x80) {
+    out->push_back(char((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(char(value));
+}
+
+// filter codes match ascii letters case insensitively.
+static string FilterCode(const string& code) {
+  string result(code);
+  for (char& c : result) {
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+  }
+  return result;
+}
+
+// byte position after the utf-8 character starting at pos.
+static size_t NextChar(const string& str, size_t pos) {
+  while (++pos < str.length() && (str[pos] & 0xc0) == 0x80) {
+  }
+  return pos;
+}
+
+// parses the version of a format string; false if it is not one.
+static bool ParseFormat(const string& format, int* major, int* minor) {
+  if (!boost::starts_with(format, kPredictFormatPrefix))
+    return false;
+  const char* version = format.c_str() + kPredictFormatPrefix.length();
+  char* end = nullptr;
+  long major_version = std::strtol(version, &end, 10);
+  if (end == version || *end != '.')
+    return false;
+  const char* minor_begin = end + 1;
+  long minor_version = std::strtol(minor_begin, &end, 10);
+  if (end == minor_begin || *end != '\0' || major_version < 0 ||
+      minor_version < 0)
+    return false;
+  *major = int(major_version);
+  *minor = int(minor_version);
+  return true;
+}
+
+static uint32_t Checksum(const char* data, size_t size) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data, size);
+  return crc.checksum();
+}
+
+static uint32_t ReadVarint(const uint8_t** ptr) {
+  uint32_t value = 0;
+  int shift = 0;
+  while (**ptr & 0x80) {
+    value |= uint32_t(*(*ptr)++ & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= uint32_t(*(*ptr)++) << shift;
+  return value;
+}
+
+// reads a varint that ends before end; false if it does not.
+static bool ReadVarint(const uint8_t** ptr,
+                       const uint8_t* end,
+                       uint32_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 35 && *ptr < end; shift += 7) {
+    uint8_t byte = *(*ptr)++;
+    *value |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// whether the count and the weights of the packed record starting at record
+// end before end, leaving a byte at least for each text index.
+static bool CheckRecordHeader(const uint8_t* record,
+                              const uint8_t* end,
+                              bool quantized_weights) {
+  uint32_t size = 0;
+  if (!ReadVarint(&record, end, &size))
+    return false;
+  size_t bytes_per_candidate = quantized_weights ? 2 : 1;
+  return size <= size_t(end - record) / bytes_per_candidate;
+}
+
+// size in bytes of the packed record starting at record, checking that it
+// ends before end and refers to texts below num_texts; 0 if it does not.
+static size_t CheckRecord(const uint8_t* record,
+                          const uint8_t* end,
+                          uint32_t num_texts,
+                          bool quantized_weights) {
+  const uint8_t* ptr = record;
+  uint32_t size = 0;
+  if (!ReadVarint(&ptr, end, &size))
+    return 0;
+  if (quantized_weights) {
+    if (size > size_t(end - ptr))
+      return 0;
+    ptr += size;
+  }
+  for (uint32_t i = 0; i < size; ++i) {
+    uint32_t index = 0;
+    if (!ReadVarint(&ptr, end, &index) || index >= num_texts)
+      return 0;
+  }
+  return ptr - record;
+}
+
+namespace predict {
+
+string ContextKey(const string& ngram_context) {
+  vector<string> words;
+  boost::split(words, boost::trim_copy(ngram_context), boost::is_any_of(" "),
+               boost::token_compress_on);
+  std::reverse(words.begin(), words.end());
+  return boost::join(words, string(1, kContextDelimiter));
+}
+
+uint8_t QuantizeWeight(double weight) {
+  if (!(weight > 0.0))
+    return 0;
+  return uint8_t((std::min)(std::round(std::log2(1.0 + weight) * 8.0), 255.0));
+}
+
+float DequantizeWeight(uint8_t quantized) {
+  static const auto kWeights = [] {
+    std::array<float, 256> weights;
+    for (size_t i = 0; i < weights.size(); ++i) {
+      weights[i] = float(std::exp2(i / 8.0) - 1.0);
+    }
+    return weights;
+  }();
+  return kWeights[quantized];
+}
+
+CandidateList::CandidateList(const Candidates* array) {
+  if (array) {
+    size_ = array->size;
+    entries_ = array->begin();
+  }
+}
+
+CandidateList::CandidateList(const uint8_t* record,
+                             const uint8_t* end,
+                             const StringId* text_ids,
+                             uint32_t num_texts,
+                             bool quantized_weights)
+    : packed_end_(end), text_ids_(text_ids), num_texts_(num_texts) {
+  size_ = ReadVarint(&record);
+  if (quantized_weights) {
+    weights_ = record;
+    record += size_;
+  }
+  packed_ = record;
+}
+
+CandidateList::Iterator CandidateList::begin() const {
+  Iterator it;
+  it.entry_ = entries_;
+  it.packed_ = packed_;
+  it.packed_end_ = packed_end_;
+  it.weights_ = weights_;
+  it.text_ids_ = text_ids_;
+  it.num_texts_ = num_texts_;
+  it.remaining_ = size_;
+  it.Decode();
+  return it;
+}
+
+double CandidateList::TotalWeight() const {
+  double total = 0.0;
+  if (entries_) {
+    for (size_t i = 0; i < size_; ++i) {
+      total += entries_[i].weight;
+    }
+  } else if (weights_) {
+    for (size_t i = 0; i < size_; ++i) {
+      total += DequantizeWeight(weights_[i]);
+    }
+  }
+  return total;
+}
+
+CandidateList::Iterator& CandidateList::Iterator::operator++() {
+  if (remaining_ == 0)
+    return *this;
+  --remaining_;
+  if (entry_)
+    ++entry_;
+  else if (weights_)
+    ++weights_;
+  Decode();
+  return *this;
+}
+
+void CandidateList::Iterator::Decode() {
+  if (remaining_ == 0)
+    return;
+  if (entry_) {
+    string_id_ = entry_->text.str_id();
+    weight_ = entry_->weight;
+  } else {
+    uint32_t index = 0;
+    string_id_ = ReadVarint(&packed_, packed_end_, &index) && index < num_texts_
+                     ? text_ids_[index]
+                     : kInvalidStringId;
+    weight_ = weights_ ? DequantizeWeight(*weights_) : 0.f;
+  }
+}
+
+std::string_view TextTable::GetStringView(StringId string_id,
+                                          marisa::Agent* agent) const {
+  agent->set_query(string_id);
+  try {
+    trie_.reverse_lookup(*agent);
+  } catch (const marisa::Exception& ex) {
+    LOG(ERROR) << "invalid string id: " << string_id << ", " << ex.what();
+    return std::string_view();
+  }
+  return std::string_view(agent->key().ptr(), agent->key().length());
+}
+
+}  // namespace predict
+
+// state of a build in progress. candidate arrays go straight to the file,
+// with string ids provisional until the string table is built at last.
+struct PredictDb::BuildState {
+  struct Text {
+    StringId provisional_id;
+    float weight;
+    uint32_t count;  // of the candidate lists it is in
+  };
+  hash_map<string, Text> texts;
+  vector<string> keys;
+  vector<int> values;  // offsets of candidate arrays, or in candidate pool
+  vector<string> filter_keys;
+  vector<int> filter_values;
+  uint32_t max_candidates = 0;
+  size_t candidate_pool_offset = 0;
+  string buffer;
+  // the db whose string table is kept by a delta build; text ids are then
+  // final, and in the compact format indices of its text_ids.
+  PredictDb* base = nullptr;
+  hash_map<StringId, StringId> base_text_indices;
+};
+
+PredictDb::PredictDb(const path& file_path)
+    : MappedFile(file_path),
+      key_trie_(new predict::DartsKeyIndex),
+      filter_trie_(new predict::DartsKeyIndex),
+      value_trie_(new predict::TextTable) {}
+
+PredictDb::~PredictDb() {}
+
 bool PredictDb::Load() {
   LOG(INFO) << "loading predict db: " << file_path();
 
   if (IsOpen())
     Close();
 
+  std::error_code ec;
+  write_time_ = std::filesystem::last_write_time(file_path(), ec);
   if (!OpenReadOnly()) {
     LOG(ERROR) << "error opening predict db '" << file_path() << "'.";
     return false;
@@ -29,20 +305,64 @@ bool PredictDb::Load() {
     return false;
   }
 
-  if (!boost::starts_with(string(metadata_->format), kPredictFormatPrefix)) {
+  // the format may fill its field without a terminating null
+  const size_t format_length =
+      strnlen(metadata_->format, predict::Metadata::kFormatMaxLength);
+  string format(metadata_->format, format_length);
+  if (!ParseFormat(format, &format_major_, &format_minor_)) {
     LOG(ERROR) << "invalid metadata.";
     Close();
     return false;
   }
+  // a newer format may lay out or encode its sections differently
+  if (format_major_ < 1 || format_major_ > 2 ||
+      format_minor_ > (format_major_ == 1 ? 3 : 1)) {
+    LOG(ERROR) << "unsupported predict db format '" << format
+               << "': " << file_path();
+    Close();
+    return false;
+  }
+  // fields since 1.1 are not present in older files
+  max_candidates_ = FormatSince(1, 1) ? metadata_->max_candidates : 0;
+  uint32_t flags = FormatSince(1, 2) ? metadata_->flags : 0;
+  // marisa tries came with 1.3 and 2.1
+  const bool marisa_format = format_minor_ == (format_major_ == 1 ? 3 : 1);
+  if ((flags & ~predict::kKnownFlags) ||
+      ((flags & predict::kMarisaKeyIndex) && !marisa_format)) {
+    LOG(ERROR) << "unsupported predict db flags " << flags << ": "
+               << file_path();
+    Close();
+    return false;
+  }
+  compact_ = FormatSince(2, 0);
+  if (compact_) {
+    if (!metadata_->candidate_pool || !metadata_->text_ids) {
+      LOG(ERROR) << "candidate pool not found.";
+      Close();
+      return false;
+    }
+    quantized_weights_ = (flags & predict::kQuantizedWeights) != 0;
+  }
+  set_key_index_type((flags & predict::kMarisaKeyIndex)
+                         ? predict::KeyIndexType::kMarisa
+                         : predict::KeyIndexType::kDarts);
+  filter_length_ = 0;
+  if (flags & predict::kFilterIndex) {
+    if (!metadata_->filter_trie) {
+      LOG(ERROR) << "filter index not found.";
+      Close();
+      return false;
+    }
+    filter_length_ = metadata_->filter_length;
+  }
 
   if (!metadata_->key_trie) {
-    LOG(ERROR) << "double array image not found.";
+    LOG(ERROR) << "key index image not found.";
     Close();
     return false;
   }
-  DLOG(INFO) << "found double array image of size " << metadata_->key_trie_size
+  DLOG(INFO) << "found key index image of size " << metadata_->key_trie_size
              << ".";
-  key_trie_->set_array(metadata_->key_trie.get(), metadata_->key_trie_size);
 
   if (!metadata_->value_trie) {
     LOG(ERROR) << "string table not found.";
@@ -51,61 +371,154 @@ bool PredictDb::Load() {
   }
   DLOG(INFO) << "found string table of size " << metadata_->value_trie.get()
              << ".";
-  value_trie_ = make_unique<StringTable>(metadata_->value_trie.get(),
-                                         metadata_->value_trie_size);
+  if (!CheckBounds() ||
+      !key_trie_->Map(metadata_->key_trie.get(), metadata_->key_trie_size) ||
+      (filter_length_ > 0 &&
+       !filter_trie_->Map(metadata_->filter_trie.get(),
+                          metadata_->filter_trie_size))) {
+    LOG(ERROR) << "predict db is truncated or corrupt: " << file_path();
+    Close();
+    return false;
+  }
+  if (first_char_index_) {
+    key_trie_->IndexFirstCharacters();
+    if (filter_length_ > 0)
+      filter_trie_->IndexFirstCharacters();
+  }
+  value_trie_ = make_unique<predict::TextTable>(metadata_->value_trie.get(),
+                                                metadata_->value_trie_size);
+  corrupt_ = false;
+  verify_once_ = make_unique<std::once_flag>();
+  checksum_verified_ = false;
 
   return true;
 }
 
+size_t PredictDb::HeaderSize() const {
+  if (FormatSince(1, 2))
+    return sizeof(predict::Metadata);
+  return FormatSince(1, 1) ? offsetof(predict::Metadata, candidate_pool)
+                           : offsetof(predict::Metadata, max_candidates);
+}
+
+// checks that every section lies within the file, without reading them.
+bool PredictDb::CheckBounds() {
+  const char* data = address() + HeaderSize();
+  const char* end = address() + file_size();
+  auto in_file = [data, end](const char* section, size_t size) {
+    return section >= data && section <= end && size <= size_t(end - section);
+  };
+  const size_t unit_size = key_trie_->unit_size();
+  if (!in_file(metadata_->key_trie.get(),
+               size_t(metadata_->key_trie_size) * unit_size) ||
+      !in_file(metadata_->value_trie.get(), metadata_->value_trie_size))
+    return false;
+  if (filter_length_ > 0 &&
+      !in_file(metadata_->filter_trie.get(),
+               size_t(metadata_->filter_trie_size) * unit_size))
+    return false;
+  if (compact_ &&
+      !in_file(reinterpret_cast<const char*>(metadata_->text_ids.get()),
+               size_t(metadata_->num_texts) * sizeof(StringId)))
+    return false;
+  // 1.x builds without the bounds of candidates write them before the trie
+  if (FormatSince(1, 2) && metadata_->candidate_pool) {
+    if (!in_file(metadata_->candidate_pool.get(),
+                 metadata_->candidate_pool_size))
+      return false;
+    candidates_begin_ = metadata_->candidate_pool.get() - address();
+    candidates_end_ = candidates_begin_ + metadata_->candidate_pool_size;
+  } else {
+    candidates_begin_ = HeaderSize();
+    candidates_end_ = metadata_->key_trie.get() - address();
+  }
+  return true;
+}
+
+bool PredictDb::VerifyChecksum(const std::atomic<bool>* cancelled) {
+  if (!metadata_ || !verify_once_)
+    return false;
+  std::call_once(*verify_once_, [this, cancelled] {
+    // dbs of older builds have no checksum
+    if (metadata_->db_checksum == 0) {
+      checksum_verified_ = true;
+      return;
+    }
+    // read by chunks, so as to give up soon when cancelled
+    const size_t kChunkSize = 1 << 20;
+    const char* data = address() + HeaderSize();
+    size_t size = file_size() - HeaderSize();
+    boost::crc_32_type crc;
+    for (size_t offset = 0; offset < size; offset += kChunkSize) {
+      if (cancelled && cancelled->load(std::memory_order_relaxed))
+        return;
+      crc.process_bytes(data + offset, (std::min)(kChunkSize, size - offset));
+    }
+    checksum_verified_ = crc.checksum() == metadata_->db_checksum;
+    if (!checksum_verified_) {
+      LOG(ERROR) << "checksum mismatch in predict db: " << file_path();
+      corrupt_ = true;
+    }
+  });
+  return checksum_verified_;
+}
+
 bool PredictDb::Save() {
   LOG(INFO) << "saving predict db: " << file_path();
-  if (!key_trie_->total_size()) {
+  if (!key_trie_->size()) {
     LOG(ERROR) << "the trie has not been constructed!";
     return false;
   }
   return ShrinkToFit();
 }
 
-int PredictDb::WriteCandidates(const vector<predict::RawEntry>& candidates,
-                               const table::Entry* entry) {
-  auto* array = CreateArray<table::Entry>(candidates.size());
-  auto* next = array->begin();
-  for (size_t i = 0; i < candidates.size(); ++i) {
-    *next++ = *entry++;
-  }
-  auto offset = reinterpret_cast<char*>(array) - address();
-  return int(offset);
-}
-
 bool PredictDb::Build(const predict::RawData& data) {
-  // create predict db
-  int data_size = data.size();
-  const size_t kReservedSize = 1024;
-
-  size_t entry_count = 0;
-  for (const auto& kv : data) {
-    entry_count += kv.second.size();
+  if (!BeginBuild())
+    return false;
+  if (!hot_first_) {
+    for (const auto& kv : data) {
+      if (!AddKey(kv.first, kv.second))
+        return false;
+    }
+    return EndBuild();
   }
-  StringTableBuilder string_table;
-  vector<table::Entry> entries(entry_count);
-  vector<const char*> keys;
-  keys.reserve(data_size);
-  int i = 0;
+  // write candidates in order of the total weight of their keys, then add
+  // the keys in ascending order
+  vector<const predict::RawData::value_type*> hot;
+  vector<double> total_weights;
   for (const auto& kv : data) {
-    if (kv.second.empty())
-      continue;
+    double total_weight = 0.0;
     for (const auto& candidate : kv.second) {
-      string_table.Add(candidate.text, candidate.weight,
-                       &entries[i].text.str_id());
-      entries[i].weight = float(candidate.weight);
-      ++i;
+      total_weight += candidate.weight;
     }
-    keys.push_back(kv.first.c_str());
+    hot.push_back(&kv);
+    total_weights.push_back(total_weight);
+  }
+  vector<size_t> order(hot.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return total_weights[a] > total_weights[b];
+  });
+  vector<int> values(hot.size(), -1);
+  for (size_t i : order) {
+    if (!hot[i]->second.empty() &&
+        !WriteKey(hot[i]->first, hot[i]->second, &values[i]))
+      return false;
+  }
+  for (size_t i = 0; i < hot.size(); ++i) {
+    if (values[i] == -1)
+      continue;
+    build_state_->keys.push_back(hot[i]->first);
+    build_state_->values.push_back(values[i]);
   }
-  // this writes to entry vector, which should be copied to entry array later
-  string_table.Build();
-  size_t value_trie_image_size = string_table.BinarySize();
-  if (!Create(value_trie_image_size)) {
+  return EndBuild();
+}
+
+bool PredictDb::BeginBuild() {
+  const size_t kReservedSize = 1024 * 1024;
+  if (!Create(kReservedSize)) {
     LOG(ERROR) << "Error creating predict db file '" << file_path() << "'.";
     return false;
   }
@@ -114,62 +527,718 @@ bool PredictDb::Build(const predict::RawData& data) {
     LOG(ERROR) << "Error creating metadata in file '" << file_path() << "'.";
     return false;
   }
+  build_state_ = make_unique<BuildState>();
+  build_state_->candidate_pool_offset = file_size();
+  return true;
+}
 
-  // copy from entry vector to entry array
-  const table::Entry* available_entries = &entries[0];
-  vector<int> values;
-  values.reserve(data_size);
-  for (const auto& kv : data) {
-    if (kv.second.empty())
-      continue;
-    values.push_back(WriteCandidates(kv.second, available_entries));
-    available_entries += kv.second.size();
+bool PredictDb::AddKey(const string& key,
+                       const vector<predict::RawEntry>& candidates) {
+  if (!build_state_) {
+    LOG(ERROR) << "predict db build has not begun.";
+    return false;
   }
+  if (candidates.empty())
+    return true;
+  auto& keys = build_state_->keys;
+  if (!keys.empty() && !(keys.back() < key)) {
+    LOG(ERROR) << "keys must be added in ascending order: '" << keys.back()
+               << "' before '" << key << "'.";
+    return false;
+  }
+  int value = 0;
+  if (!WriteKey(key, candidates, &value))
+    return false;
+  keys.push_back(key);
+  build_state_->values.push_back(value);
+  return true;
+}
+
+// writes the candidates of a key, returning their offset in value.
+bool PredictDb::WriteKey(const string& key,
+                         const vector<predict::RawEntry>& candidates,
+                         int* value) {
+  // sort by weight descending, keeping the first of identical texts
+  vector<const predict::RawEntry*> sorted;
+  sorted.reserve(candidates.size());
+  for (const auto& candidate : candidates) {
+    sorted.push_back(&candidate);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const predict::RawEntry* a, const predict::RawEntry* b) {
+                     return a->weight > b->weight;
+                   });
+  std::unordered_set<std::string_view> seen;
+  sorted.erase(std::remove_if(sorted.begin(), sorted.end(),
+                              [&seen](const predict::RawEntry* candidate) {
+                                return !seen.insert(candidate->text).second;
+                              }),
+               sorted.end());
+  if (filter_length_ > 0 && !AddFilterKeys(key, sorted))
+    return false;
+  if (candidate_limit_ > 0 && sorted.size() > candidate_limit_)
+    sorted.resize(candidate_limit_);
+  bool written =
+      compact_ ? WritePacked(sorted, value) : WriteEntries(sorted, value);
+  if (!written)
+    return false;
+  build_state_->max_candidates =
+      (std::max)(build_state_->max_candidates, uint32_t(sorted.size()));
+  return true;
+}
+
+// returns the provisional id of a text, which is its index in text_ids
+// of the compact format.
+StringId PredictDb::AddText(const predict::RawEntry& candidate) {
+  if (auto* base = build_state_->base) {
+    StringId string_id = base->value_trie_->Lookup(candidate.text);
+    return compact_ ? build_state_->base_text_indices[string_id] : string_id;
+  }
+  auto* texts = &build_state_->texts;
+  auto found = texts->find(candidate.text);
+  if (found == texts->end()) {
+    BuildState::Text text{StringId(texts->size()), 0.f, 0};
+    found = texts->emplace(candidate.text, text).first;
+  }
+  found->second.weight += float(candidate.weight);
+  ++found->second.count;
+  return found->second.provisional_id;
+}
+
+// indexes the candidates of key by each prefix of their codes, writing
+// a candidate list for every prefix.
+bool PredictDb::AddFilterKeys(
+    const string& key,
+    const vector<const predict::RawEntry*>& candidates) {
+  map<string, vector<const predict::RawEntry*>> filtered;
+  for (const auto* candidate : candidates) {
+    string code =
+        FilterCode(candidate->code.empty() ? candidate->text : candidate->code);
+    size_t end = 0;
+    for (uint32_t length = 0; end < code.length() && length < filter_length_;
+         ++length) {
+      end = NextChar(code, end);
+      auto& list = filtered[code.substr(0, end)];
+      if (candidate_limit_ == 0 || list.size() < candidate_limit_)
+        list.push_back(candidate);
+    }
+  }
+  for (const auto& kv : filtered) {
+    int value = 0;
+    bool written = compact_ ? WritePacked(kv.second, &value)
+                            : WriteEntries(kv.second, &value);
+    if (!written)
+      return false;
+    build_state_->filter_keys.push_back(key + kFilterDelimiter + kv.first);
+    build_state_->filter_values.push_back(value);
+  }
+  return true;
+}
+
+bool PredictDb::WriteEntries(
+    const vector<const predict::RawEntry*>& candidates,
+    int* value) {
+  auto* array = CreateArray<table::Entry>(candidates.size());
+  if (!array) {
+    LOG(ERROR) << "Error creating candidate array.";
+    return false;
+  }
+  auto* next = array->begin();
+  for (const auto* candidate : candidates) {
+    next->text.str_id() = AddText(*candidate);
+    next->weight = float(candidate->weight);
+    ++next;
+  }
+  *value = int(reinterpret_cast<char*>(array) - address());
+  return true;
+}
+
+bool PredictDb::WritePacked(const vector<const predict::RawEntry*>& candidates,
+                            int* value) {
+  string& record = build_state_->buffer;
+  record.clear();
+  AppendVarint(uint32_t(candidates.size()), &record);
+  if (quantized_weights_) {
+    for (const auto* candidate : candidates) {
+      record.push_back(char(predict::QuantizeWeight(candidate->weight)));
+    }
+  }
+  for (const auto* candidate : candidates) {
+    AppendVarint(AddText(*candidate), &record);
+  }
+  char* image = Allocate<char>(record.size());
+  if (!image) {
+    LOG(ERROR) << "Error creating candidate record.";
+    return false;
+  }
+  std::memcpy(image, record.data(), record.size());
+  *value = int(file_size() - record.size() -
+               build_state_->candidate_pool_offset);
+  return true;
+}
+
+// renumbers the texts of the compact format by the number of lists they
+// are in, descending, so that frequent texts take the shortest varints,
+// rewriting the candidate pool in place and reordering string_ids.
+// returns the new size of the pool, which is no larger than before.
+size_t PredictDb::RenumberTexts(BuildState* state,
+                                const vector<uint32_t>& counts,
+                                vector<StringId>* string_ids) {
+  vector<uint32_t> order(counts.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = uint32_t(i);
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&counts](uint32_t a, uint32_t b) {
+                     return counts[a] > counts[b];
+                   });
+  vector<uint32_t> new_index(order.size());
+  vector<StringId> ids(order.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    new_index[order[i]] = uint32_t(i);
+    ids[i] = (*string_ids)[order[i]];
+  }
+  string_ids->swap(ids);
+  // records are written one after another
+  auto* pool = reinterpret_cast<uint8_t*>(address()) +
+               state->candidate_pool_offset;
+  size_t pool_size = file_size() - state->candidate_pool_offset;
+  string packed;
+  packed.reserve(pool_size);
+  hash_map<int, int> offsets;
+  for (const uint8_t* ptr = pool; ptr < pool + pool_size;) {
+    offsets[int(ptr - pool)] = int(packed.size());
+    uint32_t size = ReadVarint(&ptr);
+    AppendVarint(size, &packed);
+    if (quantized_weights_) {
+      packed.append(reinterpret_cast<const char*>(ptr), size);
+      ptr += size;
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+      AppendVarint(new_index[ReadVarint(&ptr)], &packed);
+    }
+  }
+  std::memcpy(pool, packed.data(), packed.size());
+  std::memset(pool + packed.size(), 0, pool_size - packed.size());
+  for (auto* values : {&state->values, &state->filter_values}) {
+    for (int& value : *values) {
+      value = offsets[value];
+    }
+  }
+  return packed.size();
+}
+
+// pads the file so that the next section starts at a multiple of
+// alignment.
+bool PredictDb::Align(size_t alignment) {
+  size_t padding = (alignment - file_size() % alignment) % alignment;
+  return padding == 0 || Allocate<char>(padding);
+}
+
+bool PredictDb::BuildDelta(PredictDb* base, const predict::Patch& patch) {
+  if (!base->metadata_) {
+    LOG(ERROR) << "base predict db is not loaded.";
+    return false;
+  }
+  compact_ = base->compact_;
+  quantized_weights_ = base->quantized_weights_;
+  filter_length_ = base->filter_length_;
+  set_key_index_type(base->key_index_type());
+  hot_first_ = false;
+  bool reuse_texts = true;
+  for (const auto& kv : patch.added) {
+    for (const auto& candidate : kv.second) {
+      if (base->value_trie_->Lookup(candidate.text) == kInvalidStringId)
+        reuse_texts = false;
+    }
+  }
+  if (!BeginBuild())
+    return false;
+  if (reuse_texts) {
+    build_state_->base = base;
+    const StringId* text_ids = base->metadata_->text_ids.get();
+    for (uint32_t i = 0; compact_ && i < base->metadata_->num_texts; ++i) {
+      build_state_->base_text_indices[text_ids[i]] = i;
+    }
+  }
+  LOG(INFO) << "delta build from " << base->file_path()
+            << (reuse_texts ? ", keeping" : ", rebuilding")
+            << " the string table.";
+  KeyIterator keys(base);
+  CodeReader code_reader(base);
+  bool has_key = keys.Next();
+  auto added = patch.added.begin();
+  marisa::Agent agent;
+  // merges the keys of base with the patched ones in ascending order
+  while (has_key || added != patch.added.end()) {
+    bool in_base = has_key && (added == patch.added.end() ||
+                               !(added->first < keys.key()));
+    bool in_patch = added != patch.added.end() &&
+                    (!has_key || !(keys.key() < added->first));
+    const string key = in_base ? keys.key() : added->first;
+    code_reader.Seek(key);
+    auto removed = patch.removed.find(key);
+    bool patched = in_patch || removed != patch.removed.end();
+    size_t size = in_base ? base->GetCandidates(keys.value_).size() : 0;
+    if (in_base && !patched && reuse_texts &&
+        (candidate_limit_ == 0 || size <= candidate_limit_)) {
+      int value = 0;
+      if (!CopyCandidates(base, keys.value_, &value))
+        return false;
+      build_state_->keys.push_back(key);
+      build_state_->values.push_back(value);
+      build_state_->max_candidates =
+          (std::max)(build_state_->max_candidates, uint32_t(size));
+      for (const auto& code_value : code_reader.filtered()) {
+        if (!CopyCandidates(base, code_value.second, &value))
+          return false;
+        build_state_->filter_keys.push_back(key + kFilterDelimiter +
+                                            code_value.first);
+        build_state_->filter_values.push_back(value);
+      }
+    } else {
+      // codes are not stored, but recovered from the filter index
+      map<string, string> codes = code_reader.Codes();
+      vector<predict::RawEntry> candidates;
+      if (in_base) {
+        auto list = base->GetCandidates(keys.value_);
+        for (auto it = list.begin(); it != list.end(); ++it) {
+          string text(base->GetText(it.string_id(), &agent));
+          if (removed != patch.removed.end() && removed->second.count(text))
+            continue;
+          const string& code = codes[text];
+          candidates.push_back({std::move(text), it.weight(), code});
+        }
+      }
+      if (in_patch) {
+        for (predict::RawEntry candidate : added->second) {
+          // a patch without codes keeps those of base
+          if (candidate.code.empty()) {
+            auto code = codes.find(candidate.text);
+            if (code != codes.end())
+              candidate.code = code->second;
+          }
+          auto found = std::find_if(candidates.begin(), candidates.end(),
+                                    [&candidate](const predict::RawEntry& x) {
+                                      return x.text == candidate.text;
+                                    });
+          if (found == candidates.end())
+            candidates.push_back(std::move(candidate));
+          else
+            *found = std::move(candidate);
+        }
+      }
+      if (!AddKey(key, candidates))
+        return false;
+    }
+    if (in_base)
+      has_key = keys.Next();
+    if (in_patch)
+      ++added;
+  }
+  return EndBuild();
+}
+
+// copies a candidate list of base as is, keeping its text ids.
+bool PredictDb::CopyCandidates(PredictDb* base, int base_value, int* value) {
+  if (compact_) {
+    const auto* pool = reinterpret_cast<const uint8_t*>(
+        base->metadata_->candidate_pool.get());
+    const uint8_t* pool_end =
+        pool + (base->candidates_end_ - base->candidates_begin_);
+    size_t record_size =
+        size_t(base_value) < size_t(pool_end - pool)
+            ? CheckRecord(pool + base_value, pool_end,
+                          base->metadata_->num_texts, quantized_weights_)
+            : 0;
+    if (record_size == 0) {
+      LOG(ERROR) << "invalid candidate record in base predict db.";
+      return false;
+    }
+    const uint8_t* record = pool + base_value;
+    char* image = Allocate<char>(record_size);
+    if (!image) {
+      LOG(ERROR) << "Error creating candidate record.";
+      return false;
+    }
+    std::memcpy(image, record, record_size);
+    *value = int(file_size() - record_size -
+                 build_state_->candidate_pool_offset);
+  } else {
+    if (base->GetCandidates(base_value).empty()) {
+      LOG(ERROR) << "invalid candidate array in base predict db.";
+      return false;
+    }
+    const auto* source = base->Find<predict::Candidates>(base_value);
+    auto* array = CreateArray<table::Entry>(source->size);
+    if (!array) {
+      LOG(ERROR) << "Error creating candidate array.";
+      return false;
+    }
+    std::copy(source->begin(), source->end(), array->begin());
+    *value = int(reinterpret_cast<char*>(array) - address());
+  }
+  return true;
+}
+
+bool PredictDb::EndBuild() {
+  if (!build_state_) {
+    LOG(ERROR) << "predict db build has not begun.";
+    return false;
+  }
+  the<BuildState> state = std::move(build_state_);
+  const predict::Metadata* base =
+      state->base ? state->base->metadata_ : nullptr;
+  // intern the texts, then replace provisional ids in candidate arrays
+  StringTableBuilder string_table;
+  vector<StringId> string_ids(state->texts.size());
+  for (const auto& kv : state->texts) {
+    string_table.Add(kv.first, kv.second.weight,
+                     &string_ids[kv.second.provisional_id]);
+  }
+  if (!base)
+    string_table.Build();
+  vector<uint32_t> counts(state->texts.size());
+  for (const auto& kv : state->texts) {
+    counts[kv.second.provisional_id] = kv.second.count;
+  }
+  hash_map<string, BuildState::Text>().swap(state->texts);
+  size_t candidate_pool_size = file_size() - state->candidate_pool_offset;
+  if (compact_) {
+    // texts of a base keep its indices
+    if (!base)
+      candidate_pool_size = RenumberTexts(state.get(), counts, &string_ids);
+    const StringId* ids = base ? base->text_ids.get() : string_ids.data();
+    size_t num_texts = base ? base->num_texts : string_ids.size();
+    if (!Align(sizeof(StringId))) {
+      LOG(ERROR) << "Error aligning text ids.";
+      return false;
+    }
+    auto* text_ids = Allocate<StringId>(num_texts);
+    if (!text_ids) {
+      LOG(ERROR) << "Error creating text ids.";
+      return false;
+    }
+    std::copy(ids, ids + num_texts, text_ids);
+    metadata_ = reinterpret_cast<predict::Metadata*>(address());
+    metadata_->text_ids = text_ids;
+    metadata_->num_texts = uint32_t(num_texts);
+    if (quantized_weights_)
+      metadata_->flags |= predict::kQuantizedWeights;
+  } else if (!base) {
+    for (const auto* values : {&state->values, &state->filter_values}) {
+      for (int offset : *values) {
+        auto* candidates = Find<predict::Candidates>(offset);
+        for (auto* entry = candidates->begin(); entry != candidates->end();
+             ++entry) {
+          entry->text.str_id() = string_ids[entry->text.str_id()];
+        }
+      }
+    }
+  }
+  metadata_ = reinterpret_cast<predict::Metadata*>(address());
+  metadata_->candidate_pool = address() + state->candidate_pool_offset;
+  metadata_->candidate_pool_size = uint32_t(candidate_pool_size);
+  candidates_begin_ = state->candidate_pool_offset;
+  candidates_end_ = candidates_begin_ + candidate_pool_size;
   // build real key trie
-  if (0 != key_trie_->build(data_size, keys.data(), NULL, values.data())) {
-    LOG(ERROR) << "Error building double-array trie.";
+  vector<const char*> keys;
+  keys.reserve(state->keys.size());
+  for (const auto& key : state->keys) {
+    keys.push_back(key.c_str());
+  }
+  if (!key_trie_->Build(keys, state->values)) {
+    LOG(ERROR) << "Error building key index.";
+    return false;
+  }
+  // save key index image
+  if (!Align(8)) {
+    LOG(ERROR) << "Error aligning key index image.";
     return false;
   }
-  // save double-array image
-  size_t key_trie_image_size = key_trie_->total_size();
+  size_t key_trie_image_size = key_trie_->size() * key_trie_->unit_size();
   char* key_trie_image = Allocate<char>(key_trie_image_size);
   if (!key_trie_image) {
-    LOG(ERROR) << "Error creating double-array image.";
+    LOG(ERROR) << "Error creating key index image.";
     return false;
   }
-  std::memcpy(key_trie_image, key_trie_->array(), key_trie_image_size);
+  key_trie_->Dump(key_trie_image);
   metadata_ = reinterpret_cast<predict::Metadata*>(address());
   metadata_->key_trie = key_trie_image;
-  // double-array size (number of units)
-  metadata_->key_trie_size = key_trie_->size();
+  metadata_->key_trie_size = uint32_t(key_trie_->size());
+  if (key_index_type() == predict::KeyIndexType::kMarisa)
+    metadata_->flags |= predict::kMarisaKeyIndex;
+  // build and save the filter index, if any
+  if (!state->filter_keys.empty()) {
+    // filter keys come in the order candidates are written
+    vector<size_t> order(state->filter_keys.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&state](size_t a, size_t b) {
+      return state->filter_keys[a] < state->filter_keys[b];
+    });
+    keys.clear();
+    vector<int> values;
+    for (size_t i : order) {
+      keys.push_back(state->filter_keys[i].c_str());
+      values.push_back(state->filter_values[i]);
+    }
+    if (!filter_trie_->Build(keys, values)) {
+      LOG(ERROR) << "Error building filter index.";
+      return false;
+    }
+    if (!Align(8)) {
+      LOG(ERROR) << "Error aligning filter index image.";
+      return false;
+    }
+    size_t filter_trie_image_size =
+        filter_trie_->size() * filter_trie_->unit_size();
+    char* filter_trie_image = Allocate<char>(filter_trie_image_size);
+    if (!filter_trie_image) {
+      LOG(ERROR) << "Error creating filter index image.";
+      return false;
+    }
+    filter_trie_->Dump(filter_trie_image);
+    metadata_ = reinterpret_cast<predict::Metadata*>(address());
+    metadata_->filter_trie = filter_trie_image;
+    metadata_->filter_trie_size = uint32_t(filter_trie_->size());
+    metadata_->filter_length = filter_length_;
+    metadata_->flags |= predict::kFilterIndex;
+  } else {
+    filter_length_ = 0;
+  }
   // save string table
+  if (!Align(8)) {
+    LOG(ERROR) << "Error aligning value trie image.";
+    return false;
+  }
+  size_t value_trie_image_size =
+      base ? base->value_trie_size : string_table.BinarySize();
   char* value_trie_image = Allocate<char>(value_trie_image_size);
   if (!value_trie_image) {
     LOG(ERROR) << "Error creating value trie image.";
     return false;
   }
-  string_table.Dump(value_trie_image, value_trie_image_size);
+  if (base)
+    std::memcpy(value_trie_image, base->value_trie.get(),
+                value_trie_image_size);
+  else
+    string_table.Dump(value_trie_image, value_trie_image_size);
   metadata_ = reinterpret_cast<predict::Metadata*>(address());
   metadata_->value_trie = value_trie_image;
   metadata_->value_trie_size = value_trie_image_size;
   value_trie_ =
-      make_unique<StringTable>(value_trie_image, value_trie_image_size);
+      make_unique<predict::TextTable>(value_trie_image, value_trie_image_size);
+  metadata_->max_candidates = max_candidates_ = state->max_candidates;
+  metadata_->db_checksum =
+      Checksum(address() + sizeof(predict::Metadata),
+               file_size() - sizeof(predict::Metadata));
   // at last, complete the metadata
-  std::strncpy(metadata_->format, kPredictFormat.c_str(),
-               kPredictFormat.length());
+  bool marisa = key_index_type() == predict::KeyIndexType::kMarisa;
+  const string& format =
+      compact_ ? (marisa ? kPredictCompactMarisaFormat : kPredictCompactFormat)
+               : (marisa ? kPredictMarisaFormat : kPredictFormat);
+  ParseFormat(format, &format_major_, &format_minor_);
+  std::strncpy(metadata_->format, format.c_str(), format.length());
   return true;
 }
 
-predict::Candidates* PredictDb::Lookup(const string& query) {
-  int result = key_trie_->exactMatchSearch<int>(query.c_str());
+bool PredictDb::SetResidency(predict::Residency residency,
+                             size_t candidate_size) {
+  if (!metadata_ || residency == predict::Residency::kLazy)
+    return true;
+#ifdef _WIN32
+  LOG(WARNING) << "memory residency is not supported on this platform.";
+  return false;
+#else
+  // candidates are followed by the text ids of the compact format, the
+  // tries and the string table, which every lookup reads
+  char* candidates = address() + candidates_begin_;
+  char* rest = address() + candidates_end_;
+  char* end = address() + file_size();
+  if (candidate_size == 0 || candidate_size > size_t(rest - candidates))
+    candidate_size = rest - candidates;
+  std::pair<char*, char*> sections[] = {
+      {address(), candidates + candidate_size}, {rest, end}};
+  const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+  bool success = true;
+  for (auto& section : sections) {
+    // align to pages for madvise and mlock
+    char* begin = address() + (section.first - address()) / page_size *
+                                  page_size;
+    size_t length = section.second - begin;
+    if (residency == predict::Residency::kWillNeed) {
+      if (madvise(begin, length, MADV_WILLNEED) != 0) {
+        LOG(WARNING) << "madvise failed on predict db: " << file_path();
+        success = false;
+      }
+      continue;
+    }
+    if (residency == predict::Residency::kLock) {
+      if (mlock(begin, length) == 0)
+        continue;
+      LOG(WARNING) << "mlock failed on predict db, prefaulting instead: "
+                   << file_path();
+      success = false;
+    }
+    volatile char sink = 0;
+    for (const char* page = begin; page < section.second; page += page_size) {
+      sink = sink + *page;
+    }
+  }
+  return success;
+#endif
+}
+
+predict::CandidateList PredictDb::GetCandidates(int value) {
+  if (value < 0 || corrupt())
+    return predict::CandidateList();
+  if (compact_) {
+    size_t pool_size = candidates_end_ - candidates_begin_;
+    if (size_t(value) >= pool_size)
+      return predict::CandidateList();
+    const auto* pool =
+        reinterpret_cast<const uint8_t*>(metadata_->candidate_pool.get());
+    // text indices are checked as they are decoded
+    if (!CheckRecordHeader(pool + value, pool + pool_size, quantized_weights_))
+      return predict::CandidateList();
+    return predict::CandidateList(pool + value, pool + pool_size,
+                                  metadata_->text_ids.get(),
+                                  metadata_->num_texts, quantized_weights_);
+  }
+  const size_t header_size = offsetof(predict::Candidates, at);
+  if (size_t(value) < candidates_begin_ ||
+      size_t(value) + header_size > candidates_end_)
+    return predict::CandidateList();
+  const auto* candidates = Find<predict::Candidates>(value);
+  size_t capacity =
+      (candidates_end_ - value - header_size) / sizeof(table::Entry);
+  if (!candidates || candidates->size > capacity)
+    return predict::CandidateList();
+  return predict::CandidateList(candidates);
+}
+
+predict::CandidateList PredictDb::Lookup(std::string_view query) {
+  int result = key_trie_->Find(query);
   if (result == -1)
-    return nullptr;
+    return predict::CandidateList();
   else
-    return Find<predict::Candidates>(result);
+    return GetCandidates(result);
+}
+
+vector<predict::CandidateList> PredictDb::LookupBatch(
+    const vector<std::string_view>& queries) {
+  // small enough a group that prefetched candidates stay in cache
+  const size_t kGroupSize = 64;
+  vector<predict::CandidateList> results(queries.size());
+  if (!metadata_)
+    return results;
+  int values[kGroupSize];
+  const char* candidates =
+      compact_ ? metadata_->candidate_pool.get() : address();
+  for (size_t begin = 0; begin < queries.size(); begin += kGroupSize) {
+    size_t count = (std::min)(kGroupSize, queries.size() - begin);
+    key_trie_->FindBatch(&queries[begin], count, values);
+    for (size_t i = 0; i < count; ++i) {
+      if (values[i] >= 0)
+        predict::Prefetch(candidates + values[i]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      results[begin + i] = GetCandidates(values[i]);
+    }
+  }
+  return results;
+}
+
+predict::CandidateList PredictDb::LookupBackoff(std::string_view query,
+                                                size_t* matched_length) {
+  const size_t kMaxMatches = 64;
+  predict::KeyIndex::Match matches[kMaxMatches];
+  size_t num_matches =
+      key_trie_->CommonPrefixSearch(query, matches, kMaxMatches);
+  // matches come in ascending length; the longest one that ends at a word
+  // boundary is the longest known context.
+  for (size_t i = (std::min)(num_matches, kMaxMatches); i-- > 0;) {
+    size_t length = matches[i].length;
+    if (length == query.length() ||
+        query[length] == predict::kContextDelimiter) {
+      if (matched_length)
+        *matched_length = length;
+      return GetCandidates(matches[i].value);
+    }
+  }
+  return predict::CandidateList();
+}
+
+predict::CandidateList PredictDb::LookupFiltered(const string& query,
+                                                const string& prefix) {
+  if (filter_length_ == 0 || prefix.empty())
+    return predict::CandidateList();
+  // prefixes longer than indexed are not found
+  uint32_t length = 0;
+  for (size_t pos = 0; pos < prefix.length(); pos = NextChar(prefix, pos)) {
+    if (++length > filter_length_)
+      return predict::CandidateList();
+  }
+  string key = query + kFilterDelimiter + FilterCode(prefix);
+  int result = filter_trie_->Find(key);
+  if (result == -1)
+    return predict::CandidateList();
+  return GetCandidates(result);
+}
+
+PredictDb::CodeReader::CodeReader(PredictDb* db)
+    : db_(db), filter_keys_(db, true) {
+  has_filter_key_ = filter_keys_.Next();
+}
+
+void PredictDb::CodeReader::Seek(const string& key) {
+  filtered_.clear();
+  // filter keys come in the order of keys, each key followed by its code
+  // prefixes
+  const string prefix = key + kFilterDelimiter;
+  while (has_filter_key_ && filter_keys_.key() < prefix) {
+    has_filter_key_ = filter_keys_.Next();
+  }
+  while (has_filter_key_ && boost::starts_with(filter_keys_.key(), prefix)) {
+    filtered_.emplace_back(filter_keys_.key().substr(prefix.length()),
+                           filter_keys_.value_);
+    has_filter_key_ = filter_keys_.Next();
+  }
+}
+
+map<string, string> PredictDb::CodeReader::Codes() {
+  map<string, string> codes;
+  for (const auto& code_value : filtered_) {
+    auto list = db_->GetCandidates(code_value.second);
+    for (auto it = list.begin(); it != list.end(); ++it) {
+      string& code = codes[string(db_->GetText(it.string_id(), &agent_))];
+      if (code.length() < code_value.first.length())
+        code = code_value.first;
+    }
+  }
+  return codes;
+}
+
+PredictDb::KeyIterator::KeyIterator(PredictDb* db, bool filter_index)
+    : db_(db) {
+  if (filter_index && db->filter_length_ == 0)
+    return;
+  walker_ = (filter_index ? db->filter_trie_ : db->key_trie_)->Walk();
+}
+
+bool PredictDb::KeyIterator::Next() {
+  return walker_ && walker_->Next(&key_, &value_);
+}
+
+string PredictDb::GetText(StringId string_id) {
+  return value_trie_->GetString(string_id);
 }
 
-string PredictDb::GetEntryText(const ::rime::table::Entry& entry) {
-  return value_trie_->GetString(entry.text.str_id());
+std::string_view PredictDb::GetText(StringId string_id,
+                                    marisa::Agent* agent) const {
+  return value_trie_->GetStringView(string_id, agent);
 }
 
 }  // namespace rime
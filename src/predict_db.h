@@ -1,57 +1,350 @@
 #ifndef RIME_PREDICT_DB_H_
 #define RIME_PREDICT_DB_H_
 
-#include <darts.h>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <string_view>
 #include <rime/resource.h>
 #include <rime/dict/mapped_file.h>
 #include <rime/dict/string_table.h>
 #include <rime/dict/table.h>
+#include "predict_key_index.h"
 
 namespace rime {
 
 namespace predict {
 
+// the file is addressed by offsets only and never written once built, so
+// that it can be mapped read-only at any address, and shared by processes.
 struct Metadata {
   static const int kFormatMaxLength = 32;
   char format[kFormatMaxLength];
-  uint32_t db_checksum;
-  OffsetPtr<char> key_trie;  // DoubleArray (query -> offset of Candidates)
+  uint32_t db_checksum;  // crc32 of the data after metadata; 0 if unknown
+  // KeyIndex (query -> offset of Candidates), of key_trie_size units
+  OffsetPtr<char> key_trie;
   uint32_t key_trie_size;
   OffsetPtr<char> value_trie;  // StringTable
   uint32_t value_trie_size;
+  // since 1.1
+  uint32_t max_candidates;  // size of the largest candidate array
+  // since 2.0, and bounding the candidate arrays of 1.x builds since 1.2
+  OffsetPtr<char> candidate_pool;  // packed candidate lists
+  uint32_t candidate_pool_size;
+  OffsetPtr<StringId> text_ids;  // text index in candidate_pool -> StringId
+  uint32_t num_texts;
+  uint32_t flags;  // since 1.2 in 1.x
+  // with kFilterIndex
+  OffsetPtr<char> filter_trie;  // KeyIndex (query + code -> offset)
+  uint32_t filter_trie_size;
+  uint32_t filter_length;  // max characters of code prefixes indexed
+};
+
+static_assert(sizeof(Metadata) == 88,
+              "metadata layout must not depend on the platform");
+
+enum MetadataFlags : uint32_t {
+  kQuantizedWeights = 1,
+  kFilterIndex = 2,
+  kMarisaKeyIndex = 4,  // since 1.3 and 2.1; the tries are marisa tries
+  // a db with any other bit set is rejected on load
+  kKnownFlags = kQuantizedWeights | kFilterIndex | kMarisaKeyIndex,
 };
 
 using Candidates = ::rime::Array<::rime::table::Entry>;
 
+// how much of a loaded db is brought into memory ahead of lookups.
+enum class Residency {
+  kLazy,      // pages are read on first access
+  kWillNeed,  // the kernel is advised to read ahead
+  kPrefault,  // pages are touched after loading
+  kLock,      // pages are locked in memory
+};
+
+// weights on a log scale in 8 bits, for the compact format.
+uint8_t QuantizeWeight(double weight);
+float DequantizeWeight(uint8_t quantized);
+
+// the candidates of a key in a loaded db.
+// in format 1.x, an array of table::Entry; in 2.0, a record in the
+// candidate pool of varint count, optional 8-bit weights and varint text
+// indices. PredictDb checks either to lie within the candidates before
+// making a list of it; text indices are checked as they are decoded, and
+// one out of range or of the pool gives kInvalidStringId.
+class CandidateList {
+ public:
+  // forward iterator decoding one candidate at a time.
+  class Iterator {
+   public:
+    StringId string_id() const { return string_id_; }
+    float weight() const { return weight_; }
+    Iterator& operator++();
+    // iterators are compared by the number of candidates left.
+    bool operator==(const Iterator& other) const {
+      return remaining_ == other.remaining_;
+    }
+    bool operator!=(const Iterator& other) const { return !(*this == other); }
+
+   private:
+    friend class CandidateList;
+    void Decode();
+
+    const table::Entry* entry_ = nullptr;
+    const uint8_t* packed_ = nullptr;
+    const uint8_t* packed_end_ = nullptr;
+    const uint8_t* weights_ = nullptr;
+    const StringId* text_ids_ = nullptr;
+    uint32_t num_texts_ = 0;
+    size_t remaining_ = 0;
+    StringId string_id_ = kInvalidStringId;
+    float weight_ = 0.f;
+  };
+
+  CandidateList() = default;
+  explicit CandidateList(const Candidates* array);
+  // record has been checked to have its count and weights before end.
+  CandidateList(const uint8_t* record,
+                const uint8_t* end,
+                const StringId* text_ids,
+                uint32_t num_texts,
+                bool quantized_weights);
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  Iterator begin() const;
+  Iterator end() const { return Iterator(); }
+  // sum of the weights, normalizing them; 0 if weights are not kept.
+  double TotalWeight() const;
+
+ private:
+  size_t size_ = 0;
+  const table::Entry* entries_ = nullptr;
+  const uint8_t* packed_ = nullptr;
+  const uint8_t* packed_end_ = nullptr;
+  const uint8_t* weights_ = nullptr;
+  const StringId* text_ids_ = nullptr;
+  uint32_t num_texts_ = 0;
+};
+
 struct RawEntry {
   string text;
   double weight;
+  string code;  // filters the candidate as the user types; text if empty
 };
 
 using RawData = map<string, vector<RawEntry>>;
 
+// changes to the candidates of a db, applied by a delta build.
+struct Patch {
+  // texts removed from each key, before the candidates below are added
+  map<string, set<string>> removed;
+  // candidates added to each key, or reweighted if their texts are present
+  RawData added;
+};
+
+// separates the words of a multi-word context in a db key.
+// the words are stored latest first, e.g. context "w1 w2" becomes "w2\tw1",
+// so that shorter contexts are prefixes of longer ones.
+constexpr char kContextDelimiter = '\t';
+
+// converts a space separated n-gram context to a db key.
+string ContextKey(const string& ngram_context);
+
+// a StringTable that also decodes strings without allocating.
+class TextTable : public StringTable {
+ public:
+  using StringTable::StringTable;
+
+  // the view is backed by agent and valid until its next use.
+  std::string_view GetStringView(StringId string_id,
+                                 marisa::Agent* agent) const;
+};
+
 }  // namespace predict
 
 class PredictDb : public MappedFile {
  public:
-  PredictDb(const path& file_path)
-      : MappedFile(file_path),
-        key_trie_(new Darts::DoubleArray),
-        value_trie_(new StringTable) {}
+  class CodeReader;
+
+  // walks the keys of the key trie, or of the filter index, in ascending
+  // byte order, keeping only the path to the current key in memory.
+  class KeyIterator {
+   public:
+    explicit KeyIterator(PredictDb* db, bool filter_index = false);
+
+    // moves to the next key; false at the end.
+    bool Next();
+    const string& key() const { return key_; }
+    predict::CandidateList candidates() const {
+      return db_->GetCandidates(value_);
+    }
+
+   private:
+    friend class PredictDb;
+    friend class CodeReader;
+
+    PredictDb* db_;
+    the<predict::KeyIndex::Walker> walker_;
+    string key_;
+    int value_ = -1;
+  };
+
+  // reads the codes of candidates back from the filter index, which keeps
+  // the longest code prefix each text is indexed by. keys are to be read
+  // in ascending order.
+  class CodeReader {
+   public:
+    explicit CodeReader(PredictDb* db);
+
+    // moves to the filter keys of key.
+    void Seek(const string& key);
+    // code prefixes of the key and the offsets of their candidates.
+    const vector<std::pair<string, int>>& filtered() const {
+      return filtered_;
+    }
+    // codes of the texts of the key; empty without a filter index.
+    map<string, string> Codes();
+
+   private:
+    PredictDb* db_;
+    KeyIterator filter_keys_;
+    bool has_filter_key_ = false;
+    vector<std::pair<string, int>> filtered_;
+    marisa::Agent agent_;
+  };
+
+  PredictDb(const path& file_path);
+  virtual ~PredictDb();
 
   bool Load();
   bool Save();
   bool Build(const predict::RawData& data);
-  predict::Candidates* Lookup(const string& query);
-  string GetEntryText(const ::rime::table::Entry& entry);
+  // streaming build, adding one key and its candidates at a time.
+  // keys must come in ascending byte order.
+  bool BeginBuild();
+  bool AddKey(const string& key, const vector<predict::RawEntry>& candidates);
+  bool EndBuild();
+  // builds a copy of the loaded base db, in its format, with the patch
+  // applied. candidates of the keys not patched are copied as they are,
+  // and the string table too if no text is new to it.
+  bool BuildDelta(PredictDb* base, const predict::Patch& patch);
+
+  // size of the largest candidate array of the db; 0 if unknown.
+  uint32_t max_candidates() const { return max_candidates_; }
+  // keeps only so many top candidates of each key when building; 0 for all.
+  uint32_t candidate_limit() const { return candidate_limit_; }
+  void set_candidate_limit(uint32_t limit) { candidate_limit_ = limit; }
+  // whether the db is, or is to be built, in the compact 2.0 format.
+  bool compact() const { return compact_; }
+  void set_compact(bool compact) { compact_ = compact; }
+  // whether candidate weights are kept in the compact format.
+  bool quantized_weights() const { return quantized_weights_; }
+  void set_quantized_weights(bool quantized) { quantized_weights_ = quantized; }
+  // whether Build() writes candidates of the heaviest keys first, so that
+  // they share pages.
+  bool hot_first() const { return hot_first_; }
+  void set_hot_first(bool hot_first) { hot_first_ = hot_first; }
+  // candidates are also indexed by code prefixes of up to so many
+  // characters, if not 0.
+  uint32_t filter_length() const { return filter_length_; }
+  void set_filter_length(uint32_t filter_length) {
+    filter_length_ = filter_length;
+  }
+  // the kind of tries indexing the keys.
+  predict::KeyIndexType key_index_type() const { return key_trie_->type(); }
+  void set_key_index_type(predict::KeyIndexType type) {
+    key_trie_ = predict::KeyIndex::Create(type);
+    filter_trie_ = predict::KeyIndex::Create(type);
+  }
+  // bytes per unit of the index images, whose sizes metadata gives in units.
+  size_t key_index_unit_size() const { return key_trie_->unit_size(); }
+  // whether loading tabulates the first characters of keys for faster
+  // lookups, taking some 80 KiB per index of double arrays.
+  bool first_char_index() const { return first_char_index_; }
+  void set_first_char_index(bool enabled) { first_char_index_ = enabled; }
+
+  const predict::Metadata* metadata() const { return metadata_; }
+  // bytes of candidate arrays, or of the candidate pool, in the loaded db.
+  size_t candidates_size() const { return candidates_end_ - candidates_begin_; }
+  // compares the checksum of the data, reading all of it, once for the
+  // loaded file. lookups find nothing in a db that fails. gives up, leaving
+  // the db unverified, once cancelled is set.
+  bool VerifyChecksum(const std::atomic<bool>* cancelled = nullptr);
+  bool corrupt() const { return corrupt_.load(std::memory_order_relaxed); }
+  // number of distinct candidate texts.
+  size_t num_texts() const { return value_trie_->NumKeys(); }
+  // checksum of the data, telling builds apart.
+  uint32_t checksum() const { return metadata_ ? metadata_->db_checksum : 0; }
+  // modification time of the file when it was loaded.
+  std::filesystem::file_time_type write_time() const { return write_time_; }
+
+  // brings the tries, the string table and up to candidate_size bytes of
+  // candidates, from the start, into memory; 0 for all candidates.
+  bool SetResidency(predict::Residency residency, size_t candidate_size = 0);
+
+  predict::CandidateList Lookup(std::string_view query);
+  // looks up all of queries, overlapping the cache misses of their walks;
+  // the same candidates as Lookup() of each query.
+  vector<predict::CandidateList> LookupBatch(
+      const vector<std::string_view>& queries);
+  // finds the longest context among the leading words of query.
+  predict::CandidateList LookupBackoff(std::string_view query,
+                                       size_t* matched_length = nullptr);
+  // candidates of query whose code starts with prefix, in the filter index.
+  predict::CandidateList LookupFiltered(const string& query,
+                                        const string& prefix);
+  string GetText(StringId string_id);
+  std::string_view GetText(StringId string_id, marisa::Agent* agent) const;
 
  private:
-  int WriteCandidates(const vector<predict::RawEntry>& candidates,
-                      const table::Entry* entry);
+  struct BuildState;
+
+  // size of the metadata in the loaded format, which grew since 1.0.
+  size_t HeaderSize() const;
+  bool CheckBounds();
+  predict::CandidateList GetCandidates(int value);
+  bool WriteKey(const string& key,
+                const vector<predict::RawEntry>& candidates,
+                int* value);
+  StringId AddText(const predict::RawEntry& candidate);
+  bool CopyCandidates(PredictDb* base, int base_value, int* value);
+  bool AddFilterKeys(const string& key,
+                     const vector<const predict::RawEntry*>& candidates);
+  bool WriteEntries(const vector<const predict::RawEntry*>& candidates,
+                    int* value);
+  bool WritePacked(const vector<const predict::RawEntry*>& candidates,
+                   int* value);
+  size_t RenumberTexts(BuildState* state,
+                       const vector<uint32_t>& counts,
+                       vector<StringId>* string_ids);
+  bool Align(size_t alignment);
+  // whether the loaded or built format is at least major.minor.
+  bool FormatSince(int major, int minor) const {
+    return format_major_ > major ||
+           (format_major_ == major && format_minor_ >= minor);
+  }
 
   predict::Metadata* metadata_ = nullptr;
-  the<Darts::DoubleArray> key_trie_;
-  the<StringTable> value_trie_;
+  int format_major_ = 0;
+  int format_minor_ = 0;
+  uint32_t max_candidates_ = 0;
+  uint32_t candidate_limit_ = 0;
+  bool compact_ = false;
+  bool quantized_weights_ = false;
+  bool hot_first_ = false;
+  uint32_t filter_length_ = 0;
+  bool first_char_index_ = true;
+  // offsets of candidate data in the file, bounding lookups
+  size_t candidates_begin_ = 0;
+  size_t candidates_end_ = 0;
+  std::atomic<bool> corrupt_{false};
+  the<std::once_flag> verify_once_;
+  bool checksum_verified_ = false;
+  std::filesystem::file_time_type write_time_;
+  the<predict::KeyIndex> key_trie_;
+  the<predict::KeyIndex> filter_trie_;
+  the<predict::TextTable> value_trie_;
+  the<BuildState> build_state_;
 };
 
 }  // namespace rime
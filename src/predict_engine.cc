@@ -1,6 +1,11 @@
 #include "predict_engine.h"
 
+#include <algorithm>
+#include <sstream>
+#include <boost/algorithm/string.hpp>
 #include "predict_db.h"
+#include "predict_translation.h"
+#include "user_predict_db.h"
 #include <rime/candidate.h>
 #include <rime/context.h>
 #include <rime/engine.h>
@@ -17,31 +22,325 @@ namespace rime {
 
 static const ResourceType kPredictDbResourceType = {"predict_db", "", ""};
 
+// loads the db file anew if it has been modified since write_time,
+// unless it holds the same build; returns null otherwise.
+static an<PredictDb> LoadModified(const PredictDb& db,
+                                  std::filesystem::file_time_type* write_time) {
+  std::error_code ec;
+  auto current = std::filesystem::last_write_time(db.file_path(), ec);
+  if (ec || current == *write_time)
+    return nullptr;
+  *write_time = current;
+  auto new_db = New<PredictDb>(db.file_path());
+  if (!new_db->Load()) {
+    LOG(ERROR) << "failed to reload predict db: " << db.file_path();
+    return nullptr;
+  }
+  if (new_db->checksum() != 0 && new_db->checksum() == db.checksum())
+    return nullptr;
+  return new_db;
+}
+
+// identifies the content of a db by its resolved path and checksum.
+static string DbIdentity(const PredictDb& db) {
+  std::error_code ec;
+  auto resolved = std::filesystem::weakly_canonical(db.file_path(), ec);
+  std::ostringstream identity;
+  identity << (ec ? db.file_path().string() : resolved.string()) << '\t'
+           << db.checksum();
+  // without a checksum, tell builds apart by modification time
+  if (db.checksum() == 0)
+    identity << '\t' << db.write_time().time_since_epoch().count();
+  return identity.str();
+}
+
+// returns the loaded db of the same identity, if any, so that schemas
+// naming one file differently share its mapping. added tells whether db is
+// new to the shared ones.
+static an<PredictDb> ShareDb(const an<PredictDb>& db, bool* added = nullptr) {
+  static std::mutex mutex;
+  static map<string, weak<PredictDb>> shared_dbs;
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = shared_dbs.begin(); it != shared_dbs.end();) {
+    if (it->second.expired())
+      it = shared_dbs.erase(it);
+    else
+      ++it;
+  }
+  auto& shared = shared_dbs[DbIdentity(*db)];
+  if (auto existing = shared.lock())
+    return existing;
+  shared = db;
+  if (added)
+    *added = true;
+  return db;
+}
+
+static string EngineIdentity(const PredictDb& db,
+                             const UserPredictDb* user_db,
+                             const predict::Options& options,
+                             const vector<an<PredictDb>>& extra_dbs) {
+  std::ostringstream identity;
+  identity << DbIdentity(db) << '\t' << user_db << '\t'
+           << options.max_iterations << '\t' << options.max_candidates << '\t'
+           << options.context_size << '\t' << options.filter << '\t'
+           << options.reload_interval << '\t' << int(options.residency)
+           << '\t' << options.prefault_size << '\t' << options.verify_checksum
+           << '\t' << options.merge << '\t' << options.initial_quality
+           << '\t' << options.async << '\t' << options.async_wait << '\t'
+           << options.speculate;
+  for (const auto& extra_db : extra_dbs) {
+    identity << '\n' << DbIdentity(*extra_db);
+  }
+  return identity.str();
+}
+
+// commits that end a context rather than being part of it.
+static bool IsContextBreak(const CommitRecord& record) {
+  return record.type == "punct" || record.type == "raw" ||
+         record.type == "thru";
+}
+
 PredictEngine::PredictEngine(an<PredictDb> db,
-                             int max_iterations,
-                             int max_candidates)
+                             an<UserPredictDb> user_db,
+                             const predict::Options& options,
+                             vector<an<PredictDb>> extra_dbs)
     : db_(db),
-      max_iterations_(max_iterations),
-      max_candidates_(max_candidates) {}
+      extra_dbs_(std::move(extra_dbs)),
+      user_db_(user_db),
+      options_(options),
+      identity_(EngineIdentity(*db, user_db.get(), options, extra_dbs_)),
+      stats_(New<predict::Stats>()) {
+  if (options_.reload_interval > 0) {
+    watcher_ = std::thread([this] { WatchDb(); });
+  }
+  if (options_.async || options_.speculate > 0) {
+    const size_t kNumWorkers = 2;
+    workers_ = make_unique<predict::WorkerPool>(kNumWorkers);
+  }
+}
+
+PredictEngine::~PredictEngine() {
+  if (watcher_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    watcher_.join();
+  }
+  LOG(INFO) << "predict engine stats: " << stats_->ToString();
+}
 
-PredictEngine::~PredictEngine() {}
+// swaps in a new build of the db when found; sessions keep the mapping of
+// the previous one until they release their results.
+void PredictEngine::WatchDb() {
+  // the main db first, then the extra ones
+  vector<an<PredictDb>*> dbs{&db_};
+  for (auto& extra_db : extra_dbs_) {
+    dbs.push_back(&extra_db);
+  }
+  vector<std::filesystem::file_time_type> write_times;
+  for (auto* db : dbs) {
+    write_times.push_back(std::atomic_load(db)->write_time());
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  const std::chrono::seconds interval(options_.reload_interval);
+  while (!wake_.wait_for(lock, interval, [this] { return stopping_.load(); })) {
+    lock.unlock();
+    for (size_t i = 0; i < dbs.size(); ++i) {
+      auto new_db = LoadModified(*std::atomic_load(dbs[i]), &write_times[i]);
+      // a corrupt build is not switched to
+      if (new_db && options_.verify_checksum &&
+          !new_db->VerifyChecksum(&stopping_))
+        new_db.reset();
+      if (!new_db)
+        continue;
+      LOG(INFO) << "reloaded predict db: " << new_db->file_path();
+      new_db = ShareDb(new_db);
+      new_db->SetResidency(options_.residency, options_.prefault_size);
+      std::atomic_store(dbs[i], new_db);
+      if (i == 0)
+        db_version_.fetch_add(1, std::memory_order_release);
+      predict::Stats::Add(&stats_->reloads);
+    }
+    lock.lock();
+  }
+}
+
+string PredictEngine::ContextQuery(const CommitHistory& history) const {
+  string query;
+  int num_words = 0;
+  for (auto it = history.rbegin();
+       it != history.rend() && num_words < options_.context_size; ++it) {
+    if (IsContextBreak(*it))
+      break;
+    if (num_words++ > 0)
+      query += predict::kContextDelimiter;
+    query += it->text;
+  }
+  return query;
+}
+
+void PredictEngine::Learn(const CommitHistory& history) const {
+  if (!user_db_ || history.empty() || IsContextBreak(history.back()))
+    return;
+  const string& text = history.back().text;
+  // record the commit after each of its contexts, shortest first
+  string context;
+  int num_words = 0;
+  for (auto it = std::next(history.rbegin());
+       it != history.rend() && num_words < options_.context_size; ++it) {
+    if (IsContextBreak(*it))
+      break;
+    if (num_words++ > 0)
+      context += predict::kContextDelimiter;
+    context += it->text;
+    user_db_->Record(context, text);
+  }
+  if (num_words == 0)
+    user_db_->Record("$", text);
+}
+
+predict::CandidateList PredictEngine::Lookup(PredictDb* db,
+                                             const string& query,
+                                             const string& filter) const {
+  bool backoff = options_.context_size > 1;
+  if (filter.empty())
+    return backoff ? db->LookupBackoff(query) : db->Lookup(query);
+  // back off by dropping the earliest word until some candidate matches
+  string context = query;
+  while (true) {
+    auto candidates = db->LookupFiltered(context, filter);
+    size_t pos = context.rfind(predict::kContextDelimiter);
+    if (!candidates.empty() || !backoff || pos == string::npos)
+      return candidates;
+    context.resize(pos);
+  }
+}
+
+// the top decoded candidates of a query are cached, along with how many
+// more are shown, which are looked up again if the menu pages past them.
+void PredictEngine::LookupCached(const string& query,
+                                 uint32_t version,
+                                 predict::Result* result) const {
+  uint64_t hash = std::hash<string>()(query);
+  if (cache_.Get(hash, version, &result->texts, &result->weights,
+                 &result->more, &result->total_weight)) {
+    predict::Stats::Add(&stats_->cache_hits);
+    return;
+  }
+  predict::Stats::Add(&stats_->cache_misses);
+  auto candidates = Lookup(result->db.get(), query, string());
+  size_t shown = candidates.size();
+  if (options_.max_candidates > 0)
+    shown = (std::min)(shown, size_t(options_.max_candidates));
+  size_t decoded = (std::min)(shown, predict::ResultCache::kMaxTexts);
+  double total_weight = candidates.TotalWeight();
+  marisa::Agent agent;
+  auto it = candidates.begin();
+  for (size_t i = 0; i < decoded; ++i, ++it) {
+    auto text = result->db->GetText(it.string_id(), &agent);
+    result->texts.emplace_back(text.data(), text.size());
+    result->weights.push_back(
+        total_weight > 0.0 ? float(it.weight() / total_weight) : 0.f);
+  }
+  result->more = uint32_t(shown - decoded);
+  result->total_weight = total_weight;
+  cache_.Put(hash, version, result->texts, result->weights, result->more,
+             total_weight);
+}
 
-bool PredictEngine::Predict(Context* ctx, const string& context_query) {
-  DLOG(INFO) << "PredictEngine::Predict [" << context_query << "]";
-  if (const auto* candidates = db_->Lookup(context_query)) {
-    query_ = context_query;
-    candidates_ = candidates;
-    return true;
+bool PredictEngine::Predict(const string& context_query,
+                            predict::Result* result) const {
+  return Predict(context_query, string(), result);
+}
+
+bool PredictEngine::Predict(const string& context_query,
+                            const string& filter,
+                            predict::Result* result) const {
+  DLOG(INFO) << "PredictEngine::Predict [" << context_query << "] " << filter;
+  predict::ScopedTimer timer(&stats_->predict_latency);
+  // the version is read first, so that it is never newer than the db
+  uint32_t version = db_version_.load(std::memory_order_acquire);
+  result->db = db();
+  result->query = context_query;
+  result->filter = filter;
+  if (filter.empty()) {
+    LookupCached(context_query, version, result);
   } else {
-    Clear();
-    return false;
+    result->candidates = Lookup(result->db.get(), context_query, filter);
+    result->total_weight = result->candidates.TotalWeight();
+  }
+  if (user_db_) {
+    if ((result->user_db = user_db_->db())) {
+      result->user_candidates =
+          Lookup(result->user_db.get(), context_query, filter);
+      result->user_total_weight = result->user_candidates.TotalWeight();
+    }
   }
+  for (const auto& extra_db : extra_dbs_) {
+    predict::Found found{std::atomic_load(&extra_db)};
+    found.candidates = Lookup(found.db.get(), context_query, filter);
+    if (!found.candidates.empty()) {
+      found.total_weight = found.candidates.TotalWeight();
+      result->extra.push_back(std::move(found));
+    }
+  }
+  bool hit = result->size() > 0;
+  predict::Stats::Add(&stats_->lookups);
+  predict::Stats::Add(hit ? &stats_->hits : &stats_->misses);
+  return hit;
+}
+
+an<predict::Pending> PredictEngine::PredictAsync(
+    const string& context_query) const {
+  auto pending = New<predict::Pending>();
+  pending->query = context_query;
+  auto promise = std::make_shared<std::promise<bool>>();
+  pending->done = promise->get_future();
+  workers_->Post([this, pending, promise] {
+    // a prediction cancelled while queued is dropped before the lookup
+    bool predicted = !pending->cancelled.load(std::memory_order_relaxed) &&
+                     Predict(pending->query, &pending->result);
+    promise->set_value(predicted);
+  });
+  return pending;
+}
+
+an<predict::Speculation> PredictEngine::Speculate(
+    const predict::Result& result) const {
+  auto speculation = New<predict::Speculation>();
+  auto promise = std::make_shared<std::promise<void>>();
+  speculation->done = promise->get_future();
+  workers_->Post([this, result, speculation, promise] {
+    // the top candidates in the order they are shown
+    auto translation = Translate(result, Segment(0, 0));
+    for (int i = 0; i < options_.speculate && translation &&
+                    !translation->exhausted();
+         ++i, translation->Next()) {
+      if (speculation->cancelled.load(std::memory_order_relaxed))
+        break;
+      string query = NextQuery(result.query, translation->Peek()->text());
+      Predict(query, &speculation->results[query]);
+    }
+    promise->set_value();
+  });
+  return speculation;
 }
 
-void PredictEngine::Clear() {
-  DLOG(INFO) << "PredictEngine::Clear";
-  query_.clear();
-  candidates_ = nullptr;
+string PredictEngine::NextQuery(const string& context_query,
+                                const string& text) const {
+  if (context_query == "$")
+    return text;
+  // the latest words of the context follow, up to context_size in all
+  vector<string> words;
+  boost::split(words, context_query,
+               [](char c) { return c == predict::kContextDelimiter; });
+  size_t num_words = size_t((std::max)(options_.context_size - 1, 0));
+  words.resize((std::min)(words.size(), num_words));
+  words.insert(words.begin(), text);
+  return boost::join(words, string(1, predict::kContextDelimiter));
 }
 
 void PredictEngine::CreatePredictSegment(Context* ctx) const {
@@ -55,19 +354,40 @@ void PredictEngine::CreatePredictSegment(Context* ctx) const {
   DLOG(INFO) << "segments: " << ctx->composition();
 }
 
-an<Translation> PredictEngine::Translate(const Segment& segment) const {
+an<Translation> PredictEngine::Translate(const predict::Result& result,
+                                         const Segment& segment) const {
   DLOG(INFO) << "PredictEngine::Translate";
-  auto translation = New<FifoTranslation>();
-  size_t end = segment.end;
-  int i = 0;
-  for (auto* it = candidates_->begin(); it != candidates_->end(); ++it) {
-    translation->Append(
-        New<SimpleCandidate>("prediction", end, end, db_->GetEntryText(*it)));
-    i++;
-    if (max_candidates_ > 0 && i >= max_candidates_)
-      break;
+  predict::ScopedTimer timer(&stats_->translate_latency);
+  // no need to limit if the db holds no more candidates per key
+  const auto& db = result.db;
+  int max_candidates = options_.max_candidates;
+  bool limited = max_candidates > 0 &&
+                 (db->max_candidates() == 0 ||
+                  db->max_candidates() > uint32_t(max_candidates));
+  vector<PredictTranslation::Source> sources;
+  if (!result.user_candidates.empty())
+    sources.push_back(
+        {result.user_db, result.user_candidates, result.user_total_weight});
+  PredictTranslation::Source main{db, result.candidates, result.total_weight,
+                                 result.texts, result.weights, result.more};
+  if (result.more > 0) {
+    bool backoff = options_.context_size > 1;
+    string query = result.query;
+    main.lookup = [db, query, backoff] {
+      return backoff ? db->LookupBackoff(query) : db->Lookup(query);
+    };
   }
-  return translation;
+  sources.push_back(std::move(main));
+  for (const auto& found : result.extra) {
+    sources.push_back({found.db, found.candidates, found.total_weight});
+  }
+  if (sources.size() > 1)
+    limited = max_candidates > 0;
+  // a filtered prediction replaces the input it is filtered by
+  size_t start = result.filter.empty() ? segment.end : segment.start;
+  return New<PredictTranslation>(std::move(sources), start, segment.end,
+                                 limited ? max_candidates : 0, options_.merge,
+                                 options_.initial_quality, stats_);
 }
 
 PredictEngineComponent::PredictEngineComponent()
@@ -75,32 +395,136 @@ PredictEngineComponent::PredictEngineComponent()
           Service::instance().CreateResourceResolver(kPredictDbResourceType))) {
 }
 
-PredictEngineComponent::~PredictEngineComponent() {}
+PredictEngineComponent::~PredictEngineComponent() {
+  stopping_ = true;
+  verifier_.reset();
+}
 
 PredictEngine* PredictEngineComponent::Create(const Ticket& ticket) {
+  EngineConfig config;
+  if (!GetConfig(ticket, &config))
+    return nullptr;
+  return new PredictEngine(config.db, config.user_db, config.options,
+                           std::move(config.extra_dbs));
+}
+
+bool PredictEngineComponent::GetConfig(const Ticket& ticket,
+                                       EngineConfig* engine_config) {
   string db_name = "predict.db";
-  int max_candidates = 0;
-  int max_iterations = 0;
+  predict::Options options;
+  bool learn = false;
+  vector<string> extra_db_names;
   if (auto* schema = ticket.schema) {
     auto* config = schema->config();
     if (config->GetString("predictor/db", &db_name)) {
       LOG(INFO) << "custom predictor/db: " << db_name;
     }
-    if (!config->GetInt("predictor/max_candidates", &max_candidates)) {
+    if (!config->GetInt("predictor/max_candidates", &options.max_candidates)) {
       LOG(INFO) << "predictor/max_candidates is not set in schema";
     }
-    if (!config->GetInt("predictor/max_iterations", &max_iterations)) {
+    if (!config->GetInt("predictor/max_iterations", &options.max_iterations)) {
       LOG(INFO) << "predictor/max_iterations is not set in schema";
     }
+    if (!config->GetInt("predictor/context_size", &options.context_size)) {
+      LOG(INFO) << "predictor/context_size is not set in schema";
+    }
+    config->GetBool("predictor/learn", &learn);
+    config->GetBool("predictor/filter", &options.filter);
+    config->GetInt("predictor/reload_interval", &options.reload_interval);
+    config->GetBool("predictor/verify_checksum", &options.verify_checksum);
+    string residency;
+    if (config->GetString("predictor/residency", &residency)) {
+      if (residency == "willneed") {
+        options.residency = predict::Residency::kWillNeed;
+      } else if (residency == "prefault") {
+        options.residency = predict::Residency::kPrefault;
+      } else if (residency == "mlock") {
+        options.residency = predict::Residency::kLock;
+      } else if (residency != "lazy") {
+        LOG(WARNING) << "unknown predictor/residency: " << residency;
+      }
+    }
+    int prefault_size = 0;  // in megabytes
+    if (config->GetInt("predictor/prefault_size", &prefault_size) &&
+        prefault_size > 0) {
+      options.prefault_size = size_t(prefault_size) << 20;
+    }
+    if (auto list = config->GetList("predictor/extra_dbs")) {
+      for (size_t i = 0; i < list->size(); ++i) {
+        string extra_db_name;
+        if (auto value = list->GetValueAt(i))
+          value->GetString(&extra_db_name);
+        if (!extra_db_name.empty())
+          extra_db_names.push_back(extra_db_name);
+      }
+    }
+    config->GetBool("predictor/merge", &options.merge);
+    config->GetDouble("predictor/initial_quality", &options.initial_quality);
+    config->GetBool("predictor/async", &options.async);
+    config->GetInt("predictor/async_wait", &options.async_wait);
+    config->GetInt("predictor/speculate", &options.speculate);
+  }
+  engine_config->db = GetDb(db_name, options);
+  if (!engine_config->db)
+    return false;
+  if (learn)
+    engine_config->user_db = GetUserDb(db_name);
+  for (const auto& extra_db_name : extra_db_names) {
+    if (auto extra_db = GetDb(extra_db_name, options))
+      engine_config->extra_dbs.push_back(extra_db);
   }
-  if (auto db = db_pool_.GetDb(db_name)) {
-    if (db->IsOpen() || db->Load()) {
-      return new PredictEngine(db, max_iterations, max_candidates);
-    } else {
-      LOG(ERROR) << "failed to load predict db: " << db_name;
+  engine_config->options = options;
+  return true;
+}
+
+an<PredictDb> PredictEngineComponent::GetDb(const string& db_name,
+                                            const predict::Options& options) {
+  auto db = db_pool_.GetDb(db_name);
+  if (!db)
+    return nullptr;
+  if (db->IsOpen()) {
+    // the pooled db may be outdated by a new build
+    auto write_time = db->write_time();
+    if (auto new_db = LoadModified(*db, &write_time)) {
+      LOG(INFO) << "reloaded predict db: " << db_name;
+      db = new_db;
     }
   }
-  return nullptr;
+  if (!db->IsOpen() && !db->Load()) {
+    LOG(ERROR) << "failed to load predict db: " << db_name;
+    return nullptr;
+  }
+  bool added = false;
+  db = ShareDb(db, &added);
+  db->SetResidency(options.residency, options.prefault_size);
+  // each db is verified once, by a thread that no engine waits for;
+  // lookups are bounds checked meanwhile
+  if (added && options.verify_checksum) {
+    if (!verifier_)
+      verifier_ = make_unique<predict::WorkerPool>(1);
+    verifier_->Post([this, db] { db->VerifyChecksum(&stopping_); });
+  }
+  return db;
+}
+
+an<UserPredictDb> PredictEngineComponent::GetUserDb(const string& db_name) {
+  auto found = user_db_by_name_.find(db_name);
+  if (found != user_db_by_name_.end()) {
+    if (auto user_db = found->second.lock()) {
+      return user_db;
+    }
+  }
+  // e.g. predict.db learns in predict.userdb, logging to predict.userdb.log
+  path user_data_dir(Service::instance().deployer().user_data_dir);
+  string file_name = path(db_name).stem().string() + ".userdb";
+  auto user_db = New<UserPredictDb>(user_data_dir / file_name,
+                                    user_data_dir / (file_name + ".log"));
+  if (!user_db->Open()) {
+    LOG(ERROR) << "failed to open user predict db: " << file_name;
+    return nullptr;
+  }
+  user_db_by_name_[db_name] = user_db;
+  return user_db;
 }
 
 an<PredictEngine> PredictEngineComponent::GetInstance(const Ticket& ticket) {
@@ -111,13 +535,41 @@ an<PredictEngine> PredictEngineComponent::GetInstance(const Ticket& ticket) {
         return instance;
       }
     }
-    an<PredictEngine> new_instance{Create(ticket)};
-    if (new_instance) {
-      predict_engine_by_schema_id[schema->schema_id()] = new_instance;
-      return new_instance;
+    EngineConfig config;
+    if (GetConfig(ticket, &config)) {
+      // schemas with the same db and settings share an engine, which is
+      // only made if none is running
+      auto& shared = predict_engine_by_identity_[EngineIdentity(
+          *config.db, config.user_db.get(), config.options, config.extra_dbs)];
+      auto instance = shared.lock();
+      if (!instance) {
+        instance = New<PredictEngine>(config.db, config.user_db,
+                                      config.options,
+                                      std::move(config.extra_dbs));
+        shared = instance;
+      }
+      predict_engine_by_schema_id[schema->schema_id()] = instance;
+      return instance;
     }
   }
   return nullptr;
 }
 
+an<predict::Session> PredictEngineComponent::GetSession(const Ticket& ticket) {
+  // sessions of engines that are gone are forgotten, before their
+  // addresses are taken by new engines
+  for (auto it = session_by_engine_.begin(); it != session_by_engine_.end();) {
+    if (it->second.expired())
+      it = session_by_engine_.erase(it);
+    else
+      ++it;
+  }
+  auto& session = session_by_engine_[ticket.engine];
+  if (auto instance = session.lock())
+    return instance;
+  auto instance = New<predict::Session>();
+  session = instance;
+  return instance;
+}
+
 }  // namespace rime
@@ -1,41 +1,182 @@
 #ifndef RIME_PREDICT_ENGINE_H_
 #define RIME_PREDICT_ENGINE_H_
 
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include "predict_cache.h"
 #include "predict_db.h"
+#include "predict_stats.h"
+#include "predict_worker.h"
 #include <rime/component.h>
 #include <rime/dict/db_pool.h>
 
 namespace rime {
 
+class CommitHistory;
 class Context;
+class Engine;
 struct Segment;
 struct Ticket;
 class Translation;
+class UserPredictDb;
 
+namespace predict {
+
+// candidates found in one of the extra dbs.
+struct Found {
+  an<PredictDb> db;
+  CandidateList candidates;
+  double total_weight = 0.0;  // of candidates
+};
+
+// result of a lookup, owned by the session that made it.
+struct Result {
+  an<PredictDb> db;  // the db version holding candidates
+  string query;      // context looked up
+  string filter;  // code the candidates are filtered by, if any
+  CandidateList candidates;
+  // of candidates, summed once for every translation of the result
+  double total_weight = 0.0;
+  vector<string> texts;  // decoded top candidates, in place of candidates
+  vector<float> weights;  // normalized weights of texts
+  // candidates shown after texts, looked up only once they are reached,
+  // and normalized by total_weight
+  uint32_t more = 0;
+  an<PredictDb> user_db;  // learned predictions holding user_candidates
+  CandidateList user_candidates;
+  double user_total_weight = 0.0;  // of user_candidates
+  vector<Found> extra;  // in the order of the extra dbs
+
+  int size() const {
+    size_t size = candidates.size() + texts.size() + more +
+                  user_candidates.size();
+    for (const auto& found : extra) {
+      size += found.candidates.size();
+    }
+    return int(size);
+  }
+};
+
+// settings of a predict engine, from the schema.
+struct Options {
+  int max_iterations = 0;   // prediction times limit
+  int max_candidates = 0;   // prediction candidate count limit
+  int context_size = 1;     // number of previous commits to look up
+  bool filter = false;      // whether to filter predictions by input
+  int reload_interval = 0;  // seconds between checks for a new db, if not 0
+  Residency residency = Residency::kLazy;
+  size_t prefault_size = 0;  // bytes of candidates made resident, 0 for all
+  bool verify_checksum = true;  // whether db is verified in the background
+  bool merge = false;  // whether candidates of all dbs are merged by weight
+  double initial_quality = 0.0;  // added to the quality of candidates
+  bool async = false;  // whether predictions run on worker threads
+  int async_wait = 5;  // milliseconds a commit waits for an async prediction
+  int speculate = 0;   // top candidates whose next predictions are made ahead
+};
+
+// a prediction running on a worker of the engine. the session asking for
+// it cancels it when it is no longer wanted, e.g. the user has typed on.
+struct Pending {
+  string query;
+  std::atomic<bool> cancelled{false};
+  std::future<bool> done;  // whether predicted; result is then valid
+  Result result;
+
+  void Cancel() { cancelled.store(true, std::memory_order_relaxed); }
+};
+
+// predictions of the queries following the top candidates of a result,
+// made ahead on a worker for the session showing them.
+struct Speculation {
+  std::atomic<bool> cancelled{false};
+  std::future<void> done;
+  map<string, Result> results;  // by query, empty if not predicted
+
+  void Cancel() { cancelled.store(true, std::memory_order_relaxed); }
+};
+
+// the prediction on display in a session, kept by its predictor for its
+// translator, so that what is shown is translated without looking it up
+// again.
+struct Session {
+  Result result;  // of no query if nothing is shown
+};
+
+}  // namespace predict
+
+// shared by all sessions of a schema; lookups don't modify the engine.
+// the db may be swapped for a new build in the background, while results
+// keep the version they are looked up in.
 class PredictEngine : public Class<PredictEngine, const Ticket&> {
  public:
-  PredictEngine(an<PredictDb> db, int max_iterations, int max_candidates);
+  PredictEngine(an<PredictDb> db,
+                an<UserPredictDb> user_db,
+                const predict::Options& options,
+                vector<an<PredictDb>> extra_dbs = {});
   virtual ~PredictEngine();
 
-  bool Predict(Context* ctx, const string& context_query);
-  void Clear();
+  string ContextQuery(const CommitHistory& history) const;
+  // learns the last commit in history, if learning is enabled.
+  void Learn(const CommitHistory& history) const;
+  bool Predict(const string& context_query, predict::Result* result) const;
+  // predicts candidates whose codes start with filter.
+  bool Predict(const string& context_query,
+               const string& filter,
+               predict::Result* result) const;
+  // starts a prediction on a worker thread; requires the async option.
+  an<predict::Pending> PredictAsync(const string& context_query) const;
+  // starts predicting what follows each of the top candidates of result on
+  // a worker thread; requires the speculate option.
+  an<predict::Speculation> Speculate(const predict::Result& result) const;
+  // the query once text is committed after the context of query.
+  string NextQuery(const string& context_query, const string& text) const;
   void CreatePredictSegment(Context* ctx) const;
-  an<Translation> Translate(const Segment& segment) const;
-
-  int max_iterations() const { return max_iterations_; }
-  int max_candidates() const { return max_candidates_; }
-  const string& query() const { return query_; }
-  int num_candidates() const { return candidates_ ? candidates_->size : 0; }
-  string candidate(size_t i) const {
-    return candidates_ ? db_->GetEntryText(candidates_->at[i]) : string();
-  }
+  // translates a prediction, or a filtered one for the input of segment.
+  an<Translation> Translate(const predict::Result& result,
+                            const Segment& segment) const;
+
+  an<PredictDb> db() const { return std::atomic_load(&db_); }
+  // the db content and settings, telling engines that can be shared.
+  const string& identity() const { return identity_; }
+  int max_iterations() const { return options_.max_iterations; }
+  int max_candidates() const { return options_.max_candidates; }
+  int context_size() const { return options_.context_size; }
+  bool filter() const { return options_.filter; }
+  bool async() const { return options_.async; }
+  int async_wait() const { return options_.async_wait; }
+  int speculate() const { return options_.speculate; }
+  // counters shared by the sessions, updated even through a const engine.
+  predict::Stats& stats() const { return *stats_; }
 
  private:
-  an<PredictDb> db_;
-  int max_iterations_;  // prediction times limit
-  int max_candidates_;  // prediction candidate count limit
-  string query_;        // cache last query
-  const predict::Candidates* candidates_ = nullptr;  // cache last result
+  predict::CandidateList Lookup(PredictDb* db,
+                                const string& query,
+                                const string& filter) const;
+
+  void LookupCached(const string& query,
+                    uint32_t version,
+                    predict::Result* result) const;
+  void WatchDb();
+
+  an<PredictDb> db_;  // accessed atomically
+  vector<an<PredictDb>> extra_dbs_;  // each accessed atomically
+  std::atomic<uint32_t> db_version_{1};  // tells cached results of old dbs
+  const an<UserPredictDb> user_db_;
+  const predict::Options options_;
+  const string identity_;
+  const an<predict::Stats> stats_;
+  mutable predict::ResultCache cache_;
+
+  // checks for a new db every reload interval
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::atomic<bool> stopping_{false};  // also cancels verifying a new build
+  std::thread watcher_;
+  // destroyed first, joining workers that use the above
+  the<predict::WorkerPool> workers_;
 };
 
 class PredictEngineComponent : public PredictEngine::Component {
@@ -46,10 +187,31 @@ class PredictEngineComponent : public PredictEngine::Component {
   PredictEngine* Create(const Ticket& ticket) override;
 
   an<PredictEngine> GetInstance(const Ticket& ticket);
+  // the state shared by the predictor and the translator of a session.
+  an<predict::Session> GetSession(const Ticket& ticket);
 
  protected:
+  // what an engine is made of, as set by a schema.
+  struct EngineConfig {
+    an<PredictDb> db;
+    an<UserPredictDb> user_db;
+    predict::Options options;
+    vector<an<PredictDb>> extra_dbs;
+  };
+
+  // reads the settings of the schema of ticket and loads its dbs.
+  bool GetConfig(const Ticket& ticket, EngineConfig* engine_config);
+  an<PredictDb> GetDb(const string& db_name, const predict::Options& options);
+  an<UserPredictDb> GetUserDb(const string& db_name);
+
   map<string, weak<PredictEngine>> predict_engine_by_schema_id;
+  map<string, weak<PredictEngine>> predict_engine_by_identity_;
+  map<string, weak<UserPredictDb>> user_db_by_name_;
+  map<const Engine*, weak<predict::Session>> session_by_engine_;
   DbPool<PredictDb> db_pool_;
+  // verifies newly loaded dbs one at a time, until stopping
+  std::atomic<bool> stopping_{false};
+  the<predict::WorkerPool> verifier_;
 };
 
 }  // namespace rime
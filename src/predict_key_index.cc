@@ -0,0 +1,406 @@
+#include "predict_key_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+namespace rime {
+
+namespace predict {
+
+the<KeyIndex> KeyIndex::Create(KeyIndexType type) {
+  if (type == KeyIndexType::kMarisa)
+    return make_unique<MarisaKeyIndex>();
+  return make_unique<DartsKeyIndex>();
+}
+
+// CJK unified ideographs, which take 3 bytes each in utf-8.
+constexpr char32_t kFirstIdeograph = 0x4e00;
+constexpr char32_t kLastIdeograph = 0x9fff;
+constexpr size_t kIdeographLength = 3;
+
+// the ideograph key starts with, or 0.
+static inline char32_t LeadingIdeograph(std::string_view key) {
+  if (key.length() < kIdeographLength)
+    return 0;
+  uint8_t b0 = uint8_t(key[0]), b1 = uint8_t(key[1]), b2 = uint8_t(key[2]);
+  if ((b0 & 0xf0) != 0xe0 || (b1 & 0xc0) != 0x80 || (b2 & 0xc0) != 0x80)
+    return 0;
+  char32_t c = char32_t(b0 & 0x0f) << 12 | char32_t(b1 & 0x3f) << 6 |
+               char32_t(b2 & 0x3f);
+  return c >= kFirstIdeograph && c <= kLastIdeograph ? c : 0;
+}
+
+void KeyIndex::FindBatch(const std::string_view* keys,
+                         size_t num_keys,
+                         int* values) const {
+  for (size_t i = 0; i < num_keys; ++i) {
+    values[i] = Find(keys[i]);
+  }
+}
+
+bool DartsKeyIndex::Build(const vector<const char*>& keys,
+                          const vector<int>& values) {
+  first_level_.clear();
+  return trie_.build(keys.size(), keys.data(), NULL, values.data()) == 0;
+}
+
+void DartsKeyIndex::Dump(char* image) const {
+  std::memcpy(image, trie_.array(), trie_.total_size());
+}
+
+bool DartsKeyIndex::Map(const char* image, size_t size) {
+  first_level_.clear();
+  trie_.set_array(image, size);
+  return true;
+}
+
+// moves node to its child of label; false if there is none. children are
+// checked to lie within the array, which may come from a corrupt file.
+inline bool DartsKeyIndex::Step(uint32_t* node, uint8_t label) const {
+  const Unit* array = units();
+  uint32_t child = *node ^ array[*node].offset() ^ label;
+  if (child >= trie_.size() || array[child].label() != label)
+    return false;
+  *node = child;
+  return true;
+}
+
+inline int DartsKeyIndex::LeafValue(uint32_t node) const {
+  const Unit* array = units();
+  if (!array[node].has_leaf())
+    return -1;
+  uint32_t leaf = node ^ array[node].offset();
+  return leaf < trie_.size() ? int(array[leaf].value()) : -1;
+}
+
+// with the length known at compile time, the walk is unrolled.
+template <size_t kLength>
+int DartsKeyIndex::FindFrom(uint32_t node, const char* key) const {
+  for (size_t i = 0; i < kLength; ++i) {
+    if (!Step(&node, uint8_t(key[i])))
+      return -1;
+  }
+  return LeafValue(node);
+}
+
+int DartsKeyIndex::FindFrom(uint32_t node,
+                            const char* key,
+                            size_t length) const {
+  // most keys are a few CJK characters
+  switch (length) {
+    case 0:
+      return LeafValue(node);
+    case kIdeographLength:
+      return FindFrom<kIdeographLength>(node, key);
+    case 2 * kIdeographLength:
+      return FindFrom<2 * kIdeographLength>(node, key);
+    case 3 * kIdeographLength:
+      return FindFrom<3 * kIdeographLength>(node, key);
+  }
+  for (size_t i = 0; i < length; ++i) {
+    if (!Step(&node, uint8_t(key[i])))
+      return -1;
+  }
+  return LeafValue(node);
+}
+
+void DartsKeyIndex::IndexFirstCharacters() {
+  first_level_.clear();
+  if (trie_.size() == 0)
+    return;
+  first_level_.resize(kLastIdeograph - kFirstIdeograph + 1);
+  for (char32_t c = kFirstIdeograph; c <= kLastIdeograph; ++c) {
+    uint32_t node = 0;
+    if (Step(&node, uint8_t(0xe0 | (c >> 12))) &&
+        Step(&node, uint8_t(0x80 | ((c >> 6) & 0x3f))) &&
+        Step(&node, uint8_t(0x80 | (c & 0x3f))))
+      first_level_[c - kFirstIdeograph] = node;
+  }
+}
+
+int DartsKeyIndex::Find(std::string_view key) const {
+  // a length of 0 stands for a null terminated key
+  if (key.empty())
+    return -1;
+  if (first_level_.empty())
+    return trie_.exactMatchSearch<int>(key.data(), key.length());
+  if (char32_t c = LeadingIdeograph(key)) {
+    uint32_t node = first_level_[c - kFirstIdeograph];
+    if (node == 0)
+      return -1;
+    return FindFrom(node, key.data() + kIdeographLength,
+                    key.length() - kIdeographLength);
+  }
+  return FindFrom(0, key.data(), key.length());
+}
+
+// walks a group of keys in lockstep, a byte of each key per round. every
+// round prefetches the units that the next one reads, so that the cache
+// misses of the keys overlap rather than add up.
+void DartsKeyIndex::FindBatch(const std::string_view* keys,
+                              size_t num_keys,
+                              int* values) const {
+  const size_t kGroupSize = 16;
+  // the unit of node is checked to have label, unless it is one of these
+  const int kStart = -1;
+  const int kLeaf = -2;
+  struct Walk {
+    const char* key;
+    size_t remaining;
+    uint32_t node;
+    int label;
+    int* value;
+  };
+  const Unit* array = units();
+  const size_t num_units = trie_.size();
+  for (size_t begin = 0; begin < num_keys; begin += kGroupSize) {
+    size_t end = (std::min)(begin + kGroupSize, num_keys);
+    Walk walks[kGroupSize];
+    size_t num_walks = 0;
+    for (size_t i = begin; i < end; ++i) {
+      values[i] = -1;
+      std::string_view key = keys[i];
+      if (key.empty() || num_units == 0)
+        continue;
+      Walk walk{key.data(), key.length(), 0, kStart, &values[i]};
+      char32_t c = first_level_.empty() ? 0 : LeadingIdeograph(key);
+      if (c) {
+        walk.node = first_level_[c - kFirstIdeograph];
+        if (walk.node == 0)
+          continue;
+        walk.key += kIdeographLength;
+        walk.remaining -= kIdeographLength;
+      }
+      Prefetch(&array[walk.node]);
+      walks[num_walks++] = walk;
+    }
+    while (num_walks > 0) {
+      for (size_t j = 0; j < num_walks;) {
+        Walk& walk = walks[j];
+        const Unit& unit = array[walk.node];
+        uint32_t next = 0;
+        bool done = true;
+        if (walk.label == kLeaf) {
+          *walk.value = int(unit.value());
+        } else if (walk.label != kStart &&
+                   unit.label() != uint32_t(walk.label)) {
+          // not found
+        } else if (walk.remaining == 0) {
+          next = walk.node ^ unit.offset();
+          if (unit.has_leaf() && next < num_units) {
+            walk.label = kLeaf;
+            done = false;
+          }
+        } else {
+          uint8_t label = uint8_t(*walk.key++);
+          --walk.remaining;
+          next = walk.node ^ unit.offset() ^ label;
+          if (next < num_units) {
+            walk.label = label;
+            done = false;
+          }
+        }
+        if (done) {
+          walk = walks[--num_walks];
+          continue;
+        }
+        walk.node = next;
+        Prefetch(&array[next]);
+        ++j;
+      }
+    }
+  }
+}
+
+size_t DartsKeyIndex::CommonPrefixSearch(std::string_view query,
+                                         Match* matches,
+                                         size_t max_matches) const {
+  const size_t kMaxMatches = 64;
+  Darts::DoubleArray::result_pair_type results[kMaxMatches];
+  if (query.empty())
+    return 0;
+  size_t num_matches = trie_.commonPrefixSearch(
+      query.data(), results, (std::min)(max_matches, kMaxMatches),
+      query.length());
+  for (size_t i = 0; i < (std::min)(num_matches, max_matches); ++i) {
+    matches[i] = {results[i].value, results[i].length};
+  }
+  return num_matches;
+}
+
+// depth first, trying the labels of each node in ascending order; a node
+// with a leaf ends a key, which comes before any longer one.
+class DartsWalker : public KeyIndex::Walker {
+ public:
+  DartsWalker(const void* array, size_t size)
+      : units_(static_cast<const Darts::Details::DoubleArrayUnit*>(array)),
+        num_units_(size) {
+    if (units_ && num_units_ > 0)
+      stack_.push_back({0, 0});
+  }
+
+  bool Next(string* key, int* value) override {
+    while (!stack_.empty()) {
+      Frame& frame = stack_.back();
+      const auto& unit = units_[frame.node];
+      if (frame.next_label == 0) {
+        frame.next_label = 1;
+        if (unit.has_leaf() && !key_.empty()) {
+          *key = key_;
+          *value = units_[frame.node ^ unit.offset()].value();
+          return true;
+        }
+      }
+      if (frame.next_label > 0xff) {
+        stack_.pop_back();
+        if (!stack_.empty())
+          key_.pop_back();
+        continue;
+      }
+      uint32_t label = uint32_t(frame.next_label++);
+      uint32_t child = frame.node ^ unit.offset() ^ label;
+      if (child >= num_units_ || units_[child].label() != label)
+        continue;
+      key_.push_back(char(label));
+      stack_.push_back({child, 0});
+    }
+    return false;
+  }
+
+ private:
+  struct Frame {
+    uint32_t node;
+    int next_label;
+  };
+
+  const Darts::Details::DoubleArrayUnit* units_;
+  size_t num_units_;
+  vector<Frame> stack_;
+  string key_;
+};
+
+the<KeyIndex::Walker> DartsKeyIndex::Walk() const {
+  return make_unique<DartsWalker>(trie_.array(), trie_.size());
+}
+
+static size_t Align(size_t size) {
+  return (size + sizeof(int32_t) - 1) / sizeof(int32_t) * sizeof(int32_t);
+}
+
+// the size of the trie, padded
+static const size_t kMarisaHeaderSize = 8;
+
+bool MarisaKeyIndex::Build(const vector<const char*>& keys,
+                           const vector<int>& values) {
+  marisa::Keyset keyset;
+  for (const char* key : keys) {
+    keyset.push_back(key, std::strlen(key));
+  }
+  std::ostringstream trie_image;
+  try {
+    // in label order, predictive search walks the keys in byte order
+    trie_.build(keyset, MARISA_LABEL_ORDER);
+    marisa::write(trie_image, trie_);
+  } catch (const marisa::Exception& ex) {
+    LOG(ERROR) << "Error building marisa trie: " << ex.what();
+    return false;
+  }
+  const string trie = trie_image.str();
+  uint32_t trie_size = uint32_t(trie.size());
+  size_t values_offset = Align(kMarisaHeaderSize + trie.size());
+  image_.assign(values_offset + trie_.num_keys() * sizeof(int32_t), '\0');
+  std::memcpy(&image_[0], &trie_size, sizeof(trie_size));
+  std::memcpy(&image_[kMarisaHeaderSize], trie.data(), trie.size());
+  auto* image_values = reinterpret_cast<int32_t*>(&image_[values_offset]);
+  for (size_t i = 0; i < keyset.size(); ++i) {
+    image_values[keyset[i].id()] = values[i];
+  }
+  return Map(image_.data(), image_.size());
+}
+
+void MarisaKeyIndex::Dump(char* image) const {
+  std::memcpy(image, image_.data(), image_.size());
+}
+
+bool MarisaKeyIndex::Map(const char* image, size_t size) {
+  uint32_t trie_size = 0;
+  if (size < kMarisaHeaderSize)
+    return false;
+  std::memcpy(&trie_size, image, sizeof(trie_size));
+  size_t values_offset = Align(kMarisaHeaderSize + size_t(trie_size));
+  if (values_offset > size)
+    return false;
+  try {
+    trie_.map(image + kMarisaHeaderSize, trie_size);
+  } catch (const marisa::Exception& ex) {
+    LOG(ERROR) << "Error mapping marisa trie: " << ex.what();
+    return false;
+  }
+  if ((size - values_offset) / sizeof(int32_t) < trie_.num_keys())
+    return false;
+  values_ = reinterpret_cast<const int32_t*>(image + values_offset);
+  size_ = size;
+  return true;
+}
+
+int MarisaKeyIndex::Find(std::string_view key) const {
+  if (!values_)
+    return -1;
+  marisa::Agent agent;
+  agent.set_query(key.data(), key.length());
+  if (!trie_.lookup(agent))
+    return -1;
+  return values_[agent.key().id()];
+}
+
+size_t MarisaKeyIndex::CommonPrefixSearch(std::string_view query,
+                                          Match* matches,
+                                          size_t max_matches) const {
+  if (!values_)
+    return 0;
+  marisa::Agent agent;
+  agent.set_query(query.data(), query.length());
+  size_t num_matches = 0;
+  while (trie_.common_prefix_search(agent)) {
+    if (num_matches < max_matches) {
+      matches[num_matches] = {values_[agent.key().id()],
+                              agent.key().length()};
+    }
+    ++num_matches;
+  }
+  return num_matches;
+}
+
+class MarisaWalker : public KeyIndex::Walker {
+ public:
+  MarisaWalker(const marisa::Trie* trie, const int32_t* values)
+      : trie_(trie), values_(values) {
+    agent_.set_query("", 0);
+  }
+
+  bool Next(string* key, int* value) override {
+    while (values_ && trie_->predictive_search(agent_)) {
+      // the empty key, if any, comes first
+      if (agent_.key().length() == 0)
+        continue;
+      key->assign(agent_.key().ptr(), agent_.key().length());
+      *value = values_[agent_.key().id()];
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  const marisa::Trie* trie_;
+  const int32_t* values_;
+  marisa::Agent agent_;
+};
+
+the<KeyIndex::Walker> MarisaKeyIndex::Walk() const {
+  return make_unique<MarisaWalker>(&trie_, values_);
+}
+
+}  // namespace predict
+
+}  // namespace rime
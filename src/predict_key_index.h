@@ -0,0 +1,137 @@
+#ifndef RIME_PREDICT_KEY_INDEX_H_
+#define RIME_PREDICT_KEY_INDEX_H_
+
+#include <string_view>
+#include <darts.h>
+#include <marisa.h>
+#include <rime/common.h>
+
+namespace rime {
+
+namespace predict {
+
+// hints that address is to be read soon.
+inline void Prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(address);
+#endif
+}
+
+enum class KeyIndexType {
+  kDarts,   // double array; fastest
+  kMarisa,  // succinct trie; several times smaller
+};
+
+// maps the keys of a db to the offsets of their candidates. it is built
+// in memory, then dumped to an image in the db, which it maps on loading.
+class KeyIndex {
+ public:
+  struct Match {
+    int value;
+    size_t length;
+  };
+
+  // walks the keys in ascending byte order.
+  class Walker {
+   public:
+    virtual ~Walker() = default;
+    // moves to the next key; false at the end.
+    virtual bool Next(string* key, int* value) = 0;
+  };
+
+  static the<KeyIndex> Create(KeyIndexType type);
+
+  virtual ~KeyIndex() = default;
+
+  virtual KeyIndexType type() const = 0;
+  // builds the index of keys in ascending order.
+  virtual bool Build(const vector<const char*>& keys,
+                     const vector<int>& values) = 0;
+  // size of the image, in units of unit_size bytes, as in metadata.
+  virtual size_t size() const = 0;
+  virtual size_t unit_size() const = 0;
+  virtual void Dump(char* image) const = 0;
+  virtual bool Map(const char* image, size_t size) = 0;
+  // tabulates where keys starting with each CJK ideograph lead, so that
+  // lookups of them skip the first character; costs memory, if supported.
+  virtual void IndexFirstCharacters() {}
+
+  // the value of key; -1 if not found.
+  virtual int Find(std::string_view key) const = 0;
+  // finds the values of many keys at once, which may be faster than one by
+  // one.
+  virtual void FindBatch(const std::string_view* keys,
+                         size_t num_keys,
+                         int* values) const;
+  // the keys that are prefixes of query, shortest first; returns the
+  // number of matches, of which up to max_matches are stored.
+  virtual size_t CommonPrefixSearch(std::string_view query,
+                                    Match* matches,
+                                    size_t max_matches) const = 0;
+  virtual the<Walker> Walk() const = 0;
+};
+
+class DartsKeyIndex : public KeyIndex {
+ public:
+  KeyIndexType type() const override { return KeyIndexType::kDarts; }
+  bool Build(const vector<const char*>& keys,
+             const vector<int>& values) override;
+  size_t size() const override { return trie_.size(); }
+  size_t unit_size() const override { return trie_.unit_size(); }
+  void Dump(char* image) const override;
+  bool Map(const char* image, size_t size) override;
+  void IndexFirstCharacters() override;
+  int Find(std::string_view key) const override;
+  void FindBatch(const std::string_view* keys,
+                 size_t num_keys,
+                 int* values) const override;
+  size_t CommonPrefixSearch(std::string_view query,
+                            Match* matches,
+                            size_t max_matches) const override;
+  the<Walker> Walk() const override;
+
+ private:
+  using Unit = Darts::Details::DoubleArrayUnit;
+
+  const Unit* units() const { return static_cast<const Unit*>(trie_.array()); }
+  bool Step(uint32_t* node, uint8_t label) const;
+  int LeafValue(uint32_t node) const;
+  template <size_t kLength>
+  int FindFrom(uint32_t node, const char* key) const;
+  int FindFrom(uint32_t node, const char* key, size_t length) const;
+
+  Darts::DoubleArray trie_;
+  // nodes reached by each CJK ideograph from the root, 0 for none
+  vector<uint32_t> first_level_;
+};
+
+// the image holds the size of the trie in 8 bytes, so that the trie stays
+// 8-byte aligned as marisa expects, the trie, then the values by key id,
+// aligned to 4 bytes.
+class MarisaKeyIndex : public KeyIndex {
+ public:
+  KeyIndexType type() const override { return KeyIndexType::kMarisa; }
+  bool Build(const vector<const char*>& keys,
+             const vector<int>& values) override;
+  size_t size() const override { return size_; }
+  size_t unit_size() const override { return 1; }
+  void Dump(char* image) const override;
+  bool Map(const char* image, size_t size) override;
+  int Find(std::string_view key) const override;
+  size_t CommonPrefixSearch(std::string_view query,
+                            Match* matches,
+                            size_t max_matches) const override;
+  the<Walker> Walk() const override;
+
+ private:
+  marisa::Trie trie_;
+  const int32_t* values_ = nullptr;
+  size_t size_ = 0;
+  string image_;  // once built
+};
+
+}  // namespace predict
+
+}  // namespace rime
+
+#endif  // RIME_PREDICT_KEY_INDEX_H_
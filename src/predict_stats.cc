@@ -0,0 +1,70 @@
+#include "predict_stats.h"
+
+#include <sstream>
+
+namespace rime {
+
+namespace predict {
+
+void Histogram::Record(std::chrono::nanoseconds elapsed) {
+  uint64_t ns = elapsed.count() > 0 ? uint64_t(elapsed.count()) : 0;
+  int bucket = 0;
+  while (ns > 1 && bucket < kNumBuckets - 1) {
+    ns >>= 1;
+    ++bucket;
+  }
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() const {
+  uint64_t count = 0;
+  for (const auto& bucket : buckets_) {
+    count += bucket.load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+uint64_t Histogram::Percentile(double p) const {
+  uint64_t counts[kNumBuckets];
+  uint64_t total = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    total += counts[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+  if (total == 0)
+    return 0;
+  uint64_t rank = uint64_t(p * total);
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    seen += counts[i];
+    if (seen > rank)
+      return uint64_t(1) << (i + 1);
+  }
+  return uint64_t(1) << kNumBuckets;
+}
+
+string Stats::ToString() const {
+  auto get = [](const std::atomic<uint64_t>& counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  std::ostringstream out;
+  out << "lookups: " << get(lookups) << ", hits: " << get(hits)
+      << ", misses: " << get(misses)
+      << ", candidates materialized: " << get(candidates_materialized)
+      << ", selected: " << get(candidates_selected)
+      << ", iteration cutoffs: " << get(iteration_cutoffs)
+      << ", reloads: " << get(reloads)
+      << ", cache hits: " << get(cache_hits)
+      << ", misses: " << get(cache_misses)
+      << ", async deferred: " << get(async_deferred)
+      << ", dropped: " << get(async_dropped)
+      << ", speculation hits: " << get(speculation_hits)
+      << "; predict p50/p99 < " << predict_latency.Percentile(0.5) << "/"
+      << predict_latency.Percentile(0.99) << " ns"
+      << ", translate p50/p99 < " << translate_latency.Percentile(0.5) << "/"
+      << translate_latency.Percentile(0.99) << " ns";
+  return out.str();
+}
+
+}  // namespace predict
+
+}  // namespace rime
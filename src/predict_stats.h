@@ -0,0 +1,69 @@
+#ifndef RIME_PREDICT_STATS_H_
+#define RIME_PREDICT_STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <rime/common.h>
+
+namespace rime {
+
+namespace predict {
+
+// counts durations in power of 2 nanosecond buckets, without locking.
+class Histogram {
+ public:
+  // bucket i holds durations in [2^i, 2^(i+1)) ns; the last one, longer.
+  static constexpr int kNumBuckets = 32;
+
+  void Record(std::chrono::nanoseconds elapsed);
+  uint64_t count() const;
+  // upper bound of the bucket holding the p-th quantile, in ns.
+  uint64_t Percentile(double p) const;
+
+ private:
+  std::atomic<uint64_t> buckets_[kNumBuckets] = {};
+};
+
+// counters of a PredictEngine, updated with relaxed atomics on the hot
+// path and read on demand.
+struct Stats {
+  std::atomic<uint64_t> lookups{0};
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> candidates_materialized{0};
+  std::atomic<uint64_t> candidates_selected{0};
+  std::atomic<uint64_t> iteration_cutoffs{0};
+  std::atomic<uint64_t> reloads{0};
+  std::atomic<uint64_t> cache_hits{0};
+  std::atomic<uint64_t> cache_misses{0};
+  std::atomic<uint64_t> async_deferred{0};  // not done by the commit
+  std::atomic<uint64_t> async_dropped{0};   // never shown
+  std::atomic<uint64_t> speculation_hits{0};  // predictions made ahead
+  Histogram predict_latency;
+  Histogram translate_latency;
+
+  static void Add(std::atomic<uint64_t>* counter, uint64_t n = 1) {
+    counter->fetch_add(n, std::memory_order_relaxed);
+  }
+  string ToString() const;
+};
+
+// records the time from its construction to destruction in a histogram.
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Histogram* histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    histogram_->Record(std::chrono::steady_clock::now() - start_);
+  }
+
+ private:
+  Histogram* histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace predict
+
+}  // namespace rime
+
+#endif  // RIME_PREDICT_STATS_H_
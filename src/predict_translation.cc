@@ -0,0 +1,156 @@
+#include "predict_translation.h"
+
+#include <algorithm>
+#include <rime/candidate.h>
+
+namespace rime {
+
+PredictTranslation::PredictTranslation(vector<Source> sources,
+                                       size_t start,
+                                       size_t end,
+                                       int max_candidates,
+                                       bool merge,
+                                       double initial_quality,
+                                       an<predict::Stats> stats)
+    : sources_(std::move(sources)),
+      cursors_(sources_.size()),
+      merge_(merge),
+      initial_quality_(initial_quality),
+      remaining_(max_candidates > 0 ? size_t(max_candidates) : SIZE_MAX),
+      start_pos_(start),
+      end_pos_(end),
+      stats_(stats) {
+  for (size_t i = 0; i < sources_.size(); ++i) {
+    const auto& source = sources_[i];
+    auto& cursor = cursors_[i];
+    cursor.total_weight = source.total_weight;
+    if (source.texts.empty()) {
+      cursor.iter = source.candidates.begin();
+      cursor.remaining = source.candidates.size();
+    } else {
+      cursor.remaining = source.texts.size() + source.more;
+    }
+    if (cursor.remaining > 0)
+      active_.push_back(i);
+  }
+  if (merge_) {
+    std::make_heap(active_.begin(), active_.end(),
+                   [this](size_t a, size_t b) { return HeapOrder(a, b); });
+  }
+  Seek();
+}
+
+// normalized weight of the next candidate of a source.
+double PredictTranslation::Weight(size_t source_index) const {
+  const auto& source = sources_[source_index];
+  const auto& cursor = cursors_[source_index];
+  if (cursor.text_index < source.texts.size()) {
+    return cursor.text_index < source.weights.size()
+               ? source.weights[cursor.text_index]
+               : 0.0;
+  }
+  return cursor.total_weight > 0.0
+             ? cursor.iter.weight() / cursor.total_weight
+             : 0.0;
+}
+
+// the heap keeps the source of the heaviest next candidate on top, and of
+// equal weights, the one given first.
+bool PredictTranslation::HeapOrder(size_t a, size_t b) const {
+  double weight_a = Weight(a);
+  double weight_b = Weight(b);
+  return weight_a < weight_b || (weight_a == weight_b && a > b);
+}
+
+bool PredictTranslation::LookUpMore(size_t source_index) {
+  auto& source = sources_[source_index];
+  auto& cursor = cursors_[source_index];
+  if (source.lookup)
+    source.candidates = source.lookup();
+  if (source.candidates.size() <= source.texts.size())
+    return false;
+  cursor.iter = source.candidates.begin();
+  for (size_t i = 0; i < source.texts.size(); ++i) {
+    ++cursor.iter;
+  }
+  cursor.remaining = (std::min)(
+      cursor.remaining, source.candidates.size() - source.texts.size());
+  return true;
+}
+
+void PredictTranslation::Advance() {
+  candidate_.reset();
+  auto heap_order = [this](size_t a, size_t b) { return HeapOrder(a, b); };
+  if (merge_)
+    std::pop_heap(active_.begin(), active_.end(), heap_order);
+  size_t index = merge_ ? active_.back() : active_.front();
+  auto& cursor = cursors_[index];
+  const auto& source = sources_[index];
+  bool texts_given = false;
+  if (cursor.text_index < source.texts.size())
+    texts_given = ++cursor.text_index == source.texts.size();
+  else
+    ++cursor.iter;
+  bool done = --cursor.remaining == 0;
+  // the menu pages past the decoded texts
+  if (!done && texts_given)
+    done = !LookUpMore(index);
+  if (!merge_) {
+    if (done)
+      active_.erase(active_.begin());
+  } else if (done) {
+    active_.pop_back();
+  } else {
+    std::push_heap(active_.begin(), active_.end(), heap_order);
+  }
+}
+
+// moves to the next candidate to give.
+bool PredictTranslation::Seek() {
+  while (remaining_ > 0 && !active_.empty()) {
+    if (sources_.size() == 1)
+      return true;
+    Peek();
+    if (!given_.count(candidate_->text()))
+      return true;
+    Advance();
+  }
+  set_exhausted(true);
+  return false;
+}
+
+bool PredictTranslation::Next() {
+  if (exhausted())
+    return false;
+  if (sources_.size() > 1)
+    given_.insert(Peek()->text());
+  Advance();
+  --remaining_;
+  Seek();
+  return true;
+}
+
+an<Candidate> PredictTranslation::Peek() {
+  if (exhausted())
+    return nullptr;
+  if (!candidate_) {
+    size_t index = active_.front();
+    const auto& source = sources_[index];
+    const auto& cursor = cursors_[index];
+    string text;
+    if (cursor.text_index < source.texts.size()) {
+      text = source.texts[cursor.text_index];
+    } else {
+      auto view = source.db->GetText(cursor.iter.string_id(), &agent_);
+      text.assign(view.data(), view.size());
+    }
+    candidate_ = New<SimpleCandidate>("prediction", start_pos_, end_pos_,
+                                      std::move(text));
+    candidate_->set_quality(initial_quality_ + Weight(index));
+    if (stats_)
+      predict::Stats::Add(&stats_->candidates_materialized);
+  }
+  return candidate_;
+}
+
+}  // namespace rime
@@ -0,0 +1,78 @@
+#ifndef RIME_PREDICT_TRANSLATION_H_
+#define RIME_PREDICT_TRANSLATION_H_
+
+#include <functional>
+#include "predict_db.h"
+#include "predict_stats.h"
+#include <rime/translation.h>
+
+namespace rime {
+
+// walks the candidates of a prediction in the mapped db,
+// decoding the text of an entry only when it is peeked.
+// candidates from several dbs are given one db after another, or merged by
+// their normalized weights, skipping texts that have been given.
+// the quality of a candidate is its weight over the total weight of its
+// source, plus initial_quality.
+class PredictTranslation : public Translation {
+ public:
+  struct Source {
+    an<PredictDb> db;
+    predict::CandidateList candidates;
+    double total_weight = 0.0;  // of candidates
+    vector<string> texts;  // decoded already, given before candidates
+    vector<float> weights;  // normalized weights of texts
+    // candidates given after texts, looked up by lookup once reached; the
+    // list it returns starts with those of texts.
+    size_t more = 0;
+    std::function<predict::CandidateList()> lookup;
+  };
+
+  PredictTranslation(vector<Source> sources,
+                     size_t start,
+                     size_t end,
+                     int max_candidates,
+                     bool merge = false,
+                     double initial_quality = 0.0,
+                     an<predict::Stats> stats = nullptr);
+
+  bool Next() override;
+  an<Candidate> Peek() override;
+
+ private:
+  // position in a source.
+  struct Cursor {
+    predict::CandidateList::Iterator iter;
+    size_t text_index = 0;
+    size_t remaining = 0;
+    double total_weight = 0.0;
+  };
+
+  double Weight(size_t source_index) const;
+  // looks up the candidates of a source following its texts; false if
+  // there are none.
+  bool LookUpMore(size_t source_index);
+  void Advance();
+  bool Seek();
+  // orders the sources by the weight of their next candidates.
+  bool HeapOrder(size_t a, size_t b) const;
+
+  vector<Source> sources_;
+  vector<Cursor> cursors_;
+  // sources with candidates left; the current one is at front, which is
+  // the top of a heap if merging.
+  vector<size_t> active_;
+  bool merge_;
+  double initial_quality_;
+  size_t remaining_;  // candidates left to give
+  size_t start_pos_;
+  size_t end_pos_;
+  marisa::Agent agent_;
+  an<Candidate> candidate_;  // decoded candidate at iter_
+  set<string> given_;        // texts given, if there are several sources
+  an<predict::Stats> stats_;
+};
+
+}  // namespace rime
+
+#endif  // RIME_PREDICT_TRANSLATION_H_
@@ -15,30 +15,30 @@
 namespace rime {
 
 PredictTranslator::PredictTranslator(const Ticket& ticket,
-                                     an<PredictEngine> predict_engine)
-    : Translator(ticket), predict_engine_(predict_engine) {}
+                                     an<PredictEngine> predict_engine,
+                                     an<predict::Session> session)
+    : Translator(ticket),
+      predict_engine_(predict_engine),
+      session_(session) {}
 
 an<Translation> PredictTranslator::Query(const string& input,
                                          const Segment& segment) {
-  if (!predict_engine_)
+  if (!predict_engine_ || !session_)
     return nullptr;
-  if (predict_engine_->query().empty() || !segment.HasTag("prediction")) {
+  bool filtered = !segment.HasTag("prediction");
+  // narrow down the prediction as the user types the next word
+  if (filtered && (!predict_engine_->filter() || segment.start != 0))
     return nullptr;
-  }
-  int num_candidates = predict_engine_->num_candidates();
-  if (num_candidates > 0) {
-    int max_candidates = predict_engine_->max_candidates();
-    auto translation = New<FifoTranslation>();
-    size_t end = segment.end;
-    for (int i = 0; i < num_candidates; ++i) {
-      translation->Append(New<SimpleCandidate>("prediction", end, end,
-                                               predict_engine_->candidate(i)));
-      if (max_candidates > 0 && i >= max_candidates)
-        break;
-    }
-    return translation;
-  }
-  return nullptr;
+  const auto& shown = session_->result;
+  if (shown.query.empty() || !engine_->context()->get_option("prediction"))
+    return nullptr;
+  // the predictor has looked up what is shown
+  if (!filtered)
+    return predict_engine_->Translate(shown, segment);
+  predict::Result result;
+  if (!predict_engine_->Predict(shown.query, input, &result))
+    return nullptr;
+  return predict_engine_->Translate(result, segment);
 }
 
 PredictTranslatorComponent::PredictTranslatorComponent(
@@ -48,7 +48,8 @@ PredictTranslatorComponent::PredictTranslatorComponent(
 PredictTranslatorComponent::~PredictTranslatorComponent() {}
 
 PredictTranslator* PredictTranslatorComponent::Create(const Ticket& ticket) {
-  return new PredictTranslator(ticket, engine_factory_->GetInstance(ticket));
+  return new PredictTranslator(ticket, engine_factory_->GetInstance(ticket),
+                               engine_factory_->GetSession(ticket));
 }
 
 }  // namespace rime
@@ -9,14 +9,21 @@ class Context;
 class PredictEngine;
 class PredictEngineComponent;
 
+namespace predict {
+struct Session;
+}  // namespace predict
+
 class PredictTranslator : public Translator {
  public:
-  PredictTranslator(const Ticket& ticket, an<PredictEngine> predict_engine);
+  PredictTranslator(const Ticket& ticket,
+                    an<PredictEngine> predict_engine,
+                    an<predict::Session> session);
 
   an<Translation> Query(const string& input, const Segment& segment) override;
 
  private:
   an<PredictEngine> predict_engine_;
+  an<predict::Session> session_;  // holding the prediction shown
 };
 
 class PredictTranslatorComponent : public PredictTranslator::Component {
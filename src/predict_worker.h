@@ -0,0 +1,38 @@
+#ifndef RIME_PREDICT_WORKER_H_
+#define RIME_PREDICT_WORKER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <rime/common.h>
+
+namespace rime {
+
+namespace predict {
+
+// a few threads running tasks in the order they are posted.
+// tasks not yet started are dropped when the pool is destroyed.
+class WorkerPool {
+ public:
+  explicit WorkerPool(size_t num_threads);
+  ~WorkerPool();
+
+  void Post(std::function<void()> task);
+
+ private:
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_ = false;
+  vector<std::thread> threads_;
+};
+
+}  // namespace predict
+
+}  // namespace rime
+
+#endif  // RIME_PREDICT_WORKER_H_
@@ -14,10 +14,14 @@
 
 namespace rime {
 
-Predictor::Predictor(const Ticket& ticket, an<PredictEngine> predict_engine)
-    : Processor(ticket), predict_engine_(predict_engine) {
+Predictor::Predictor(const Ticket& ticket,
+                     an<PredictEngine> predict_engine,
+                     an<predict::Session> session)
+    : Processor(ticket), predict_engine_(predict_engine), session_(session) {
   // update prediction on context change.
   auto* context = engine_->context();
+  commit_connection_ = context->commit_notifier().connect(
+      [this](Context* ctx) { ++num_commits_; });
   select_connection_ = context->select_notifier().connect(
       [this](Context* ctx) { OnSelect(ctx); });
   context_update_connection_ = context->update_notifier().connect(
@@ -25,6 +29,9 @@ Predictor::Predictor(const Ticket& ticket, an<PredictEngine> predict_engine)
 }
 
 Predictor::~Predictor() {
+  CancelPending();
+  CancelSpeculation();
+  commit_connection_.disconnect();
   select_connection_.disconnect();
   context_update_connection_.disconnect();
 }
@@ -33,11 +40,22 @@ ProcessResult Predictor::ProcessKeyEvent(const KeyEvent& key_event) {
   if (!engine_ || !predict_engine_)
     return kNoop;
   auto keycode = key_event.keycode();
-  if (keycode == XK_BackSpace || keycode == XK_Escape) {
+  auto* ctx = engine_->context();
+  // an async prediction shows up on the release of the key committing,
+  // waiting for it as long as on the commit; a press means the user goes
+  // on, and would replace it at once
+  if (pending_) {
+    if (key_event.release())
+      PublishPending(ctx, true);
+    else
+      CancelPending();
+  }
+  // editing the input filtering a prediction keeps the prediction
+  bool editing = predict_engine_->filter() && !ctx->composition().empty() &&
+                 !ctx->composition().back().HasTag("prediction");
+  if (keycode == XK_Escape || (keycode == XK_BackSpace && !editing)) {
     last_action_ = kDelete;
-    predict_engine_->Clear();
-    iteration_counter_ = 0;
-    auto* ctx = engine_->context();
+    ClearPrediction(ctx);
     if (!ctx->composition().empty() &&
         ctx->composition().back().HasTag("prediction")) {
       ctx->Clear();
@@ -54,30 +72,50 @@ void Predictor::OnSelect(Context* ctx) {
 }
 
 void Predictor::OnContextUpdate(Context* ctx) {
-  if (self_updating_ || !predict_engine_ || !ctx ||
-      !ctx->composition().empty() || !ctx->get_option("prediction") ||
-      last_action_ == kDelete) {
+  if (pending_ && !ctx->composition().empty())
+    CancelPending();
+  if (self_updating_ || !predict_engine_ || !ctx)
+    return;
+  // the prediction is gone once turned off, or replaced by input that does
+  // not filter it
+  if (!ctx->get_option("prediction")) {
+    ClearPrediction(ctx);
+    return;
+  }
+  if (!ctx->composition().empty()) {
+    if (!predict_engine_->filter() &&
+        !ctx->composition().back().HasTag("prediction"))
+      session_->result = predict::Result();
     return;
   }
+  if (last_action_ == kDelete)
+    return;
   LOG(INFO) << "Predictor::OnContextUpdate";
   if (ctx->commit_history().empty()) {
     PredictAndUpdate(ctx, "$");
     return;
   }
-  auto last_commit = ctx->commit_history().back();
+  const auto& last_commit = ctx->commit_history().back();
   if (last_commit.type == "punct" || last_commit.type == "raw" ||
       last_commit.type == "thru") {
-    predict_engine_->Clear();
-    iteration_counter_ = 0;
+    ClearPrediction(ctx);
     return;
   }
-  if (last_commit.type == "prediction") {
+  // the prediction may be shown again for the same commit, after the
+  // input filtering it is deleted
+  bool new_commit = num_commits_ != last_learned_commit_;
+  if (new_commit) {
+    predict_engine_->Learn(ctx->commit_history());
+    last_learned_commit_ = num_commits_;
+  }
+  if (new_commit && last_commit.type == "prediction") {
+    auto& stats = predict_engine_->stats();
+    predict::Stats::Add(&stats.candidates_selected);
     int max_iterations = predict_engine_->max_iterations();
     iteration_counter_++;
     if (max_iterations > 0 && iteration_counter_ >= max_iterations) {
-      predict_engine_->Clear();
-      iteration_counter_ = 0;
-      auto* ctx = engine_->context();
+      predict::Stats::Add(&stats.iteration_cutoffs);
+      ClearPrediction(ctx);
       if (!ctx->composition().empty() &&
           ctx->composition().back().HasTag("prediction")) {
         ctx->Clear();
@@ -85,18 +123,102 @@ void Predictor::OnContextUpdate(Context* ctx) {
       return;
     }
   }
-  PredictAndUpdate(ctx, last_commit.text);
+  PredictAndUpdate(ctx,
+                   predict_engine_->ContextQuery(ctx->commit_history()));
 }
 
 void Predictor::PredictAndUpdate(Context* ctx, const string& context_query) {
-  if (predict_engine_->Predict(ctx, context_query)) {
+  if (UseSpeculation(ctx, context_query))
+    return;
+  if (predict_engine_->async()) {
+    CancelPending();
+    // the input typed meanwhile is not filtering the previous prediction
+    session_->result = predict::Result();
+    pending_ = predict_engine_->PredictAsync(context_query);
+    // the commit waits no longer than async_wait
+    std::chrono::milliseconds wait(predict_engine_->async_wait());
+    if (pending_->done.wait_for(wait) == std::future_status::ready)
+      PublishPending(ctx, false);
+    else
+      predict::Stats::Add(&predict_engine_->stats().async_deferred);
+    return;
+  }
+  predict::Result result;
+  bool predicted = predict_engine_->Predict(context_query, &result);
+  Update(ctx, predicted, std::move(result));
+}
+
+void Predictor::Update(Context* ctx, bool predicted, predict::Result result) {
+  if (predicted) {
+    // translated as the segment is composed
+    session_->result = std::move(result);
     predict_engine_->CreatePredictSegment(ctx);
     self_updating_ = true;
     ctx->update_notifier()(ctx);
     self_updating_ = false;
+    // the next query is one of the candidates shown
+    if (predict_engine_->speculate() > 0)
+      speculation_ = predict_engine_->Speculate(session_->result);
+  } else {
+    session_->result = predict::Result();
   }
 }
 
+void Predictor::PublishPending(Context* ctx, bool wait) {
+  std::chrono::milliseconds timeout(wait ? predict_engine_->async_wait() : 0);
+  if (!pending_ ||
+      pending_->done.wait_for(timeout) != std::future_status::ready)
+    return;
+  auto pending = std::move(pending_);
+  bool predicted = pending->done.get();
+  // the input may have changed without a key, or prediction turned off
+  if (!ctx->composition().empty() || !ctx->get_option("prediction")) {
+    predict::Stats::Add(&predict_engine_->stats().async_dropped);
+    return;
+  }
+  Update(ctx, predicted, std::move(pending->result));
+}
+
+void Predictor::CancelPending() {
+  if (!pending_)
+    return;
+  pending_->Cancel();
+  predict::Stats::Add(&predict_engine_->stats().async_dropped);
+  pending_.reset();
+}
+
+bool Predictor::UseSpeculation(Context* ctx, const string& context_query) {
+  auto speculation = std::move(speculation_);
+  if (!speculation)
+    return false;
+  speculation->Cancel();
+  if (speculation->done.wait_for(std::chrono::seconds(0)) !=
+      std::future_status::ready)
+    return false;
+  auto found = speculation->results.find(context_query);
+  if (found == speculation->results.end())
+    return false;
+  predict::Stats::Add(&predict_engine_->stats().speculation_hits);
+  // shown and translated as it is, decoded on the worker already
+  bool predicted = found->second.size() > 0;
+  Update(ctx, predicted, std::move(found->second));
+  return true;
+}
+
+void Predictor::CancelSpeculation() {
+  if (speculation_) {
+    speculation_->Cancel();
+    speculation_.reset();
+  }
+}
+
+void Predictor::ClearPrediction(Context* ctx) {
+  CancelPending();
+  CancelSpeculation();
+  session_->result = predict::Result();
+  iteration_counter_ = 0;
+}
+
 PredictorComponent::PredictorComponent(
     an<PredictEngineComponent> engine_factory)
     : engine_factory_(engine_factory) {}
@@ -104,7 +226,8 @@ PredictorComponent::PredictorComponent(
 PredictorComponent::~PredictorComponent() {}
 
 Predictor* PredictorComponent::Create(const Ticket& ticket) {
-  return new Predictor(ticket, engine_factory_->GetInstance(ticket));
+  return new Predictor(ticket, engine_factory_->GetInstance(ticket),
+                       engine_factory_->GetSession(ticket));
 }
 
 }  // namespace rime
@@ -9,9 +9,18 @@ class Context;
 class PredictEngine;
 class PredictEngineComponent;
 
+namespace predict {
+struct Pending;
+struct Result;
+struct Session;
+struct Speculation;
+}  // namespace predict
+
 class Predictor : public Processor {
  public:
-  Predictor(const Ticket& ticket, an<PredictEngine> predict_engine);
+  Predictor(const Ticket& ticket,
+            an<PredictEngine> predict_engine,
+            an<predict::Session> session);
   virtual ~Predictor();
 
   ProcessResult ProcessKeyEvent(const KeyEvent& key_event) override;
@@ -20,14 +29,32 @@ class Predictor : public Processor {
   void OnContextUpdate(Context* ctx);
   void OnSelect(Context* ctx);
   void PredictAndUpdate(Context* ctx, const string& context_query);
+  // shows result, which is kept for the translator, if predicted.
+  void Update(Context* ctx, bool predicted, predict::Result result);
+  // shows the async prediction if it is done, waiting for it up to
+  // async_wait if asked to, and still wanted; made by the committing key
+  // or its release.
+  void PublishPending(Context* ctx, bool wait);
+  void CancelPending();
+  // shows the prediction made ahead for the query, if it is done.
+  bool UseSpeculation(Context* ctx, const string& context_query);
+  void CancelSpeculation();
+  void ClearPrediction(Context* ctx);
 
  private:
   enum Action { kUnspecified, kSelect, kDelete };
   Action last_action_ = kUnspecified;
   bool self_updating_ = false;
   int iteration_counter_ = 0;  // times has been predicted
+  // commits of the context, telling new ones from the last one learned
+  uint64_t num_commits_ = 0;
+  uint64_t last_learned_commit_ = 0;
+  an<predict::Pending> pending_;  // async prediction not yet shown
+  an<predict::Speculation> speculation_;  // of the prediction shown
 
   an<PredictEngine> predict_engine_;
+  an<predict::Session> session_;  // holding the prediction shown
+  connection commit_connection_;
   connection select_connection_;
   connection context_update_connection_;
 };
@@ -0,0 +1,232 @@
+#include "user_predict_db.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <boost/algorithm/string.hpp>
+
+namespace rime {
+
+// a learned weight halves after so many later commits
+static const double kHalfLife = 1000.0;
+// entries decayed below this are forgotten at compaction
+static const double kMinScore = 0.1;
+static const uint32_t kMaxCandidates = 32;
+// compact after so many commits, or once the user pauses typing
+static const size_t kCompactCommits = 64;
+static const auto kFlushInterval = std::chrono::seconds(2);
+
+static double Decay(double score, uint64_t elapsed) {
+  return score * std::exp2(-double(elapsed) / kHalfLife);
+}
+
+// versions of the db found next to db_path, as files db_path.N.
+static map<uint64_t, path> ListVersions(const path& db_path) {
+  map<uint64_t, path> versions;
+  const string prefix = db_path.filename().string() + ".";
+  std::error_code ec;
+  std::filesystem::directory_iterator it(db_path.parent_path(), ec);
+  for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+    string name = it->path().filename().string();
+    if (!boost::starts_with(name, prefix))
+      continue;
+    string suffix = name.substr(prefix.length());
+    if (suffix.empty() ||
+        suffix.find_first_not_of("0123456789") != string::npos)
+      continue;
+    versions[std::strtoull(suffix.c_str(), nullptr, 10)] = it->path();
+  }
+  return versions;
+}
+
+UserPredictDb::UserPredictDb(const path& db_path, const path& log_path)
+    : db_path_(db_path), log_path_(log_path) {}
+
+UserPredictDb::~UserPredictDb() {
+  if (writer_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+  }
+}
+
+bool UserPredictDb::Open() {
+  LOG(INFO) << "loading user predict log: " << log_path_;
+  // each line: tick, score, text, and context which may contain tabs
+  std::ifstream in(log_path_.string());
+  string line;
+  while (std::getline(in, line)) {
+    vector<string> fields;
+    boost::split(fields, line, boost::is_any_of("\t"));
+    if (fields.size() < 4) {
+      LOG(WARNING) << "invalid user predict log line: " << line;
+      continue;
+    }
+    auto tick = std::strtoull(fields[0].c_str(), nullptr, 10);
+    double score = std::strtod(fields[1].c_str(), nullptr);
+    string context = line.substr(fields[0].length() + fields[1].length() +
+                                 fields[2].length() + 3);
+    Apply(tick, score, context, fields[2]);
+  }
+  auto versions = ListVersions(db_path_);
+  if (!versions.empty()) {
+    version_ = versions.rbegin()->first;
+    auto db = New<PredictDb>(versions.rbegin()->second);
+    if (db->Load())
+      std::atomic_store(&db_, db);
+  }
+  if (!db_ && !entries_.empty())
+    num_pending_ = 1;  // rebuild the missing db
+  RemoveOldVersions();
+  writer_ = std::thread([this] { Run(); });
+  return true;
+}
+
+void UserPredictDb::Record(const string& context, const string& text) {
+  if (context.empty() || text.empty() ||
+      text.find_first_of("\t\n") != string::npos ||
+      context.find('\n') != string::npos) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back({context, text});
+  }
+  wake_.notify_one();
+}
+
+void UserPredictDb::Run() {
+  vector<Commit> commits;
+  bool stopping = false;
+  while (!stopping) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait_for(lock, kFlushInterval,
+                     [this] { return stopping_ || !queue_.empty(); });
+      commits.swap(queue_);
+      stopping = stopping_;
+    }
+    // compact when enough commits pile up, or when idle
+    bool idle = commits.empty();
+    if (!idle) {
+      AppendLog(commits);
+      commits.clear();
+    }
+    if (num_pending_ >= kCompactCommits ||
+        (num_pending_ > 0 && (idle || stopping))) {
+      Compact();
+    }
+  }
+}
+
+void UserPredictDb::Apply(uint64_t tick,
+                          double score,
+                          const string& context,
+                          const string& text) {
+  auto& entry = entries_[context][text];
+  entry.score = Decay(entry.score, tick - (std::min)(entry.tick, tick)) +
+                score;
+  entry.tick = tick;
+  tick_ = (std::max)(tick_, tick);
+}
+
+bool UserPredictDb::AppendLog(const vector<Commit>& commits) {
+  std::ofstream out(log_path_.string(), std::ios::app);
+  for (const auto& commit : commits) {
+    ++tick_;
+    Apply(tick_, 1.0, commit.context, commit.text);
+    out << tick_ << '\t' << 1 << '\t' << commit.text << '\t' << commit.context
+        << '\n';
+    ++num_pending_;
+  }
+  out.flush();
+  if (!out) {
+    LOG(ERROR) << "error writing user predict log: " << log_path_;
+    return false;
+  }
+  return true;
+}
+
+bool UserPredictDb::Compact() {
+  DLOG(INFO) << "compacting user predict log: " << log_path_;
+  num_pending_ = 0;
+  predict::RawData data;
+  path log_tmp_path(log_path_.string() + ".tmp");
+  {
+    std::ofstream out(log_tmp_path.string());
+    out << std::setprecision(6);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      auto& texts = it->second;
+      for (auto entry = texts.begin(); entry != texts.end();) {
+        double score = Decay(entry->second.score, tick_ - entry->second.tick);
+        if (score < kMinScore) {
+          entry = texts.erase(entry);
+          continue;
+        }
+        out << entry->second.tick << '\t' << entry->second.score << '\t'
+            << entry->first << '\t' << it->first << '\n';
+        data[it->first].push_back({entry->first, score});
+        ++entry;
+      }
+      it = texts.empty() ? entries_.erase(it) : std::next(it);
+    }
+    if (!out.flush()) {
+      LOG(ERROR) << "error writing user predict log: " << log_tmp_path;
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(log_tmp_path, log_path_, ec);
+  if (ec) {
+    LOG(ERROR) << "error replacing user predict log: " << ec.message();
+    return false;
+  }
+  if (data.empty()) {
+    std::atomic_store(&db_, an<PredictDb>());
+    return true;
+  }
+  // build a new version, leaving the mapped ones to the sessions holding
+  // them
+  path db_tmp_path(db_path_.string() + ".tmp");
+  {
+    PredictDb tmp(db_tmp_path);
+    tmp.set_candidate_limit(kMaxCandidates);
+    if (!tmp.Build(data) || !tmp.Save()) {
+      LOG(ERROR) << "error building user predict db: " << db_tmp_path;
+      return false;
+    }
+  }
+  path version_path = VersionPath(version_ + 1);
+  std::filesystem::rename(db_tmp_path, version_path, ec);
+  if (ec) {
+    LOG(ERROR) << "error creating user predict db: " << ec.message();
+    return false;
+  }
+  auto db = New<PredictDb>(version_path);
+  if (!db->Load())
+    return false;
+  ++version_;
+  std::atomic_store(&db_, db);
+  RemoveOldVersions();
+  return true;
+}
+
+path UserPredictDb::VersionPath(uint64_t version) const {
+  return path(db_path_.string() + "." + std::to_string(version));
+}
+
+void UserPredictDb::RemoveOldVersions() {
+  for (const auto& version : ListVersions(db_path_)) {
+    if (version.first >= version_)
+      break;
+    // fails while mapped on some platforms; tried again next time
+    std::error_code ec;
+    std::filesystem::remove(version.second, ec);
+  }
+}
+
+}  // namespace rime
@@ -0,0 +1,69 @@
+#ifndef RIME_USER_PREDICT_DB_H_
+#define RIME_USER_PREDICT_DB_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "predict_db.h"
+
+namespace rime {
+
+// predictions learned from the user's commits.
+// commits are queued and written to an append log by a background thread,
+// which periodically compacts the log and rebuilds a PredictDb from it.
+// weights are commit frequencies that decay with every later commit.
+// each build goes to a new file, db_path.N, as a file still mapped by
+// sessions cannot be replaced on every platform.
+class UserPredictDb {
+ public:
+  UserPredictDb(const path& db_path, const path& log_path);
+  ~UserPredictDb();
+
+  // replays the log and starts the background writer.
+  bool Open();
+  // queues a text committed after context; doesn't wait for disk.
+  void Record(const string& context, const string& text);
+  // the learned predictions as of the last compaction, or null.
+  an<PredictDb> db() const { return std::atomic_load(&db_); }
+
+ private:
+  struct Entry {
+    double score;
+    uint64_t tick;  // when the score was last updated
+  };
+  struct Commit {
+    string context;
+    string text;
+  };
+
+  void Run();
+  void Apply(uint64_t tick,
+             double score,
+             const string& context,
+             const string& text);
+  bool AppendLog(const vector<Commit>& commits);
+  bool Compact();
+  path VersionPath(uint64_t version) const;
+  // removes the files of versions before the current one, if not in use.
+  void RemoveOldVersions();
+
+  path db_path_;
+  path log_path_;
+  // owned by the background thread once started
+  map<string, map<string, Entry>> entries_;
+  uint64_t tick_ = 0;
+  size_t num_pending_ = 0;  // commits logged since last compaction
+  uint64_t version_ = 0;  // of the latest build, 0 if none
+
+  an<PredictDb> db_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  vector<Commit> queue_;
+  bool stopping_ = false;
+  std::thread writer_;
+};
+
+}  // namespace rime
+
+#endif  // RIME_USER_PREDICT_DB_H_
@@ -0,0 +1,330 @@
+//
+// Copyright RIME Developers
+//
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <boost/algorithm/string.hpp>
+#include <rime/candidate.h>
+#include <rime/common.h>
+#include <rime/segmentation.h>
+#include <rime/translation.h>
+#include "predict_db.h"
+#include "predict_engine.h"
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace rime;
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+  size_t num_keys = 100000;
+  size_t fan_out = 16;        // candidates per key
+  size_t vocabulary = 50000;  // distinct candidate texts
+  size_t min_length = 1;      // characters per text or key
+  size_t max_length = 4;
+  size_t num_queries = 100000;
+  int max_candidates = 0;  // candidates translated, 0 for all
+  bool compact = false;
+  bool marisa = false;  // key index
+  uint32_t seed = 1;
+  path db_path{"bench_predict.db"};
+  string output;  // json file, stdout if empty
+};
+
+// latencies in nanoseconds.
+struct Latency {
+  size_t count = 0;
+  double mean = 0;
+  double p50 = 0;
+  double p99 = 0;
+};
+
+static Latency Summarize(vector<double>* samples) {
+  Latency latency;
+  if (samples->empty())
+    return latency;
+  std::sort(samples->begin(), samples->end());
+  auto percentile = [samples](double p) {
+    size_t i = (std::min)(samples->size() - 1, size_t(p * samples->size()));
+    return (*samples)[i];
+  };
+  latency.count = samples->size();
+  double sum = 0;
+  for (double sample : *samples) {
+    sum += sample;
+  }
+  latency.mean = sum / samples->size();
+  latency.p50 = percentile(0.5);
+  latency.p99 = percentile(0.99);
+  return latency;
+}
+
+static double Nanoseconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static long PeakRssKb() {
+#ifndef _WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    return usage.ru_maxrss;
+#endif
+  return 0;
+}
+
+// random text of CJK ideographs, which take 3 bytes each in utf-8.
+static string RandomText(const BenchOptions& options, std::mt19937* rng) {
+  std::uniform_int_distribution<size_t> length_dist(options.min_length,
+                                                    options.max_length);
+  std::uniform_int_distribution<uint32_t> char_dist(0x4e00, 0x9fff);
+  string text;
+  for (size_t i = length_dist(*rng); i > 0; --i) {
+    uint32_t c = char_dist(*rng);
+    text.push_back(char(0xe0 | (c >> 12)));
+    text.push_back(char(0x80 | ((c >> 6) & 0x3f)));
+    text.push_back(char(0x80 | (c & 0x3f)));
+  }
+  return text;
+}
+
+// builds a db of random keys, each predicting fan_out texts of the
+// vocabulary; returns the keys in ascending order.
+static bool BuildDb(const BenchOptions& options,
+                    std::mt19937* rng,
+                    vector<string>* keys) {
+  vector<string> texts(options.vocabulary);
+  for (auto& text : texts) {
+    text = RandomText(options, rng);
+  }
+  set<string> key_set;
+  for (size_t tries = 0;
+       key_set.size() < options.num_keys && tries < options.num_keys * 4;
+       ++tries) {
+    key_set.insert(RandomText(options, rng));
+  }
+  keys->assign(key_set.begin(), key_set.end());
+  PredictDb db(options.db_path);
+  db.set_compact(options.compact);
+  if (options.marisa)
+    db.set_key_index_type(predict::KeyIndexType::kMarisa);
+  if (!db.BeginBuild())
+    return false;
+  std::uniform_int_distribution<size_t> text_dist(0, texts.size() - 1);
+  std::uniform_real_distribution<double> weight_dist(0.0, 1000.0);
+  vector<predict::RawEntry> candidates(options.fan_out);
+  for (const auto& key : *keys) {
+    for (auto& candidate : candidates) {
+      candidate.text = texts[text_dist(*rng)];
+      candidate.weight = weight_dist(*rng);
+    }
+    if (!db.AddKey(key, candidates))
+      return false;
+  }
+  return db.EndBuild() && db.Save();
+}
+
+static void WriteLatency(std::ostream& out,
+                         const char* name,
+                         const Latency& latency) {
+  out << "    \"" << name << "\": {\"count\": " << latency.count
+      << ", \"mean_ns\": " << latency.mean << ", \"p50_ns\": " << latency.p50
+      << ", \"p99_ns\": " << latency.p99 << "}";
+}
+
+int main(int argc, char* argv[]) {
+  BenchOptions options;
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    auto value = [&arg]() { return arg.substr(arg.find('=') + 1); };
+    if (boost::starts_with(arg, "--keys=")) {
+      options.num_keys = std::stoul(value());
+    } else if (boost::starts_with(arg, "--fan-out=")) {
+      options.fan_out = std::stoul(value());
+    } else if (boost::starts_with(arg, "--vocabulary=")) {
+      options.vocabulary = std::stoul(value());
+    } else if (boost::starts_with(arg, "--min-length=")) {
+      options.min_length = std::stoul(value());
+    } else if (boost::starts_with(arg, "--max-length=")) {
+      options.max_length = std::stoul(value());
+    } else if (boost::starts_with(arg, "--queries=")) {
+      options.num_queries = std::stoul(value());
+    } else if (boost::starts_with(arg, "--max-candidates=")) {
+      options.max_candidates = std::stoi(value());
+    } else if (boost::starts_with(arg, "--seed=")) {
+      options.seed = uint32_t(std::stoul(value()));
+    } else if (arg == "--compact") {
+      options.compact = true;
+    } else if (arg == "--key-index=marisa") {
+      options.marisa = true;
+    } else if (boost::starts_with(arg, "--db=")) {
+      options.db_path = path(value());
+    } else if (boost::starts_with(arg, "--output=")) {
+      options.output = value();
+    } else {
+      std::cerr << "usage: bench_predict [--keys=N] [--fan-out=N] "
+                   "[--vocabulary=N] [--min-length=N] [--max-length=N] "
+                   "[--queries=N] [--max-candidates=N] [--seed=N] "
+                   "[--compact] [--key-index=marisa] [--db=FILE] "
+                   "[--output=FILE]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (options.num_keys == 0 || options.fan_out == 0 ||
+      options.vocabulary == 0 || options.min_length == 0 ||
+      options.max_length < options.min_length) {
+    LOG(ERROR) << "invalid benchmark options.";
+    return 1;
+  }
+  std::mt19937 rng(options.seed);
+
+  vector<string> keys;
+  auto build_start = Clock::now();
+  if (!BuildDb(options, &rng, &keys)) {
+    LOG(ERROR) << "failed to build " << options.db_path;
+    return 1;
+  }
+  double build_seconds =
+      Nanoseconds(build_start, Clock::now()) / 1000000000.0;
+  long build_peak_rss_kb = PeakRssKb();
+
+  auto db = New<PredictDb>(options.db_path);
+  auto load_start = Clock::now();
+  if (!db->Load()) {
+    LOG(ERROR) << "failed to load " << options.db_path;
+    return 1;
+  }
+  double load_ns = Nanoseconds(load_start, Clock::now());
+  size_t file_size = db->file_size();
+
+  // queries hit random keys; every fourth one misses
+  vector<string> queries(options.num_queries);
+  std::uniform_int_distribution<size_t> key_dist(0, keys.size() - 1);
+  for (size_t i = 0; i < queries.size(); ++i) {
+    queries[i] = i % 4 == 3 ? RandomText(options, &rng) + "?"
+                            : keys[key_dist(rng)];
+  }
+
+  // results add up to a checksum, so that no work is optimized away
+  size_t checksum = 0;
+  vector<double> samples;
+  samples.reserve(queries.size());
+  for (const auto& query : queries) {
+    auto start = Clock::now();
+    auto candidates = db->Lookup(query);
+    samples.push_back(Nanoseconds(start, Clock::now()));
+    checksum += candidates.size();
+  }
+  Latency lookup = Summarize(&samples);
+
+  // the same lookups, walking every byte of the keys in the trie
+  PredictDb generic_db(options.db_path);
+  generic_db.set_first_char_index(false);
+  if (!generic_db.Load()) {
+    LOG(ERROR) << "failed to load " << options.db_path;
+    return 1;
+  }
+  samples.clear();
+  for (const auto& query : queries) {
+    auto start = Clock::now();
+    auto candidates = generic_db.Lookup(query);
+    samples.push_back(Nanoseconds(start, Clock::now()));
+    checksum += candidates.size();
+  }
+  Latency lookup_generic = Summarize(&samples);
+
+  // throughput of the lookups one by one, then all at once
+  auto scalar_start = Clock::now();
+  for (const auto& query : queries) {
+    checksum += db->Lookup(query).size();
+  }
+  double scalar_ns = Nanoseconds(scalar_start, Clock::now());
+  vector<std::string_view> query_views(queries.begin(), queries.end());
+  auto batch_start = Clock::now();
+  for (const auto& candidates : db->LookupBatch(query_views)) {
+    checksum += candidates.size();
+  }
+  double batch_ns = Nanoseconds(batch_start, Clock::now());
+
+  samples.clear();
+  marisa::Agent agent;
+  for (const auto& query : queries) {
+    auto candidates = db->Lookup(query);
+    for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+      auto start = Clock::now();
+      checksum += db->GetText(it.string_id(), &agent).size();
+      samples.push_back(Nanoseconds(start, Clock::now()));
+    }
+  }
+  Latency get_text = Summarize(&samples);
+
+  samples.clear();
+  predict::Options engine_options;
+  engine_options.max_candidates = options.max_candidates;
+  engine_options.verify_checksum = false;
+  PredictEngine engine(db, nullptr, engine_options);
+  Segment segment(0, 0);
+  for (const auto& query : queries) {
+    auto start = Clock::now();
+    predict::Result result;
+    if (engine.Predict(query, &result)) {
+      auto translation = engine.Translate(result, segment);
+      for (; translation && !translation->exhausted(); translation->Next()) {
+        checksum += translation->Peek()->text().size();
+      }
+    }
+    samples.push_back(Nanoseconds(start, Clock::now()));
+  }
+  Latency translate = Summarize(&samples);
+
+  std::ofstream file;
+  if (!options.output.empty()) {
+    file.open(options.output);
+    if (!file) {
+      LOG(ERROR) << "error opening " << options.output;
+      return 1;
+    }
+  }
+  std::ostream& out = options.output.empty() ? std::cout : file;
+  out << "{\n"
+      << "  \"options\": {\"keys\": " << keys.size()
+      << ", \"fan_out\": " << options.fan_out
+      << ", \"vocabulary\": " << options.vocabulary
+      << ", \"min_length\": " << options.min_length
+      << ", \"max_length\": " << options.max_length
+      << ", \"queries\": " << options.num_queries
+      << ", \"max_candidates\": " << options.max_candidates
+      << ", \"compact\": " << (options.compact ? "true" : "false")
+      << ", \"key_index\": \"" << (options.marisa ? "marisa" : "darts") << "\""
+      << ", \"seed\": " << options.seed << "},\n"
+      << "  \"build\": {\"seconds\": " << build_seconds
+      << ", \"file_size\": " << file_size
+      << ", \"peak_rss_kb\": " << build_peak_rss_kb << "},\n"
+      << "  \"load_ns\": " << load_ns << ",\n"
+      << "  \"latency\": {\n";
+  WriteLatency(out, "lookup", lookup);
+  out << ",\n";
+  WriteLatency(out, "lookup_generic", lookup_generic);
+  out << ",\n";
+  WriteLatency(out, "get_text", get_text);
+  out << ",\n";
+  WriteLatency(out, "translate", translate);
+  out << "\n  },\n";
+  if (lookup.mean > 0)
+    out << "  \"lookup_speedup\": " << lookup_generic.mean / lookup.mean
+        << ",\n";
+  if (scalar_ns > 0 && batch_ns > 0)
+    out << "  \"lookup_throughput\": {\"scalar_qps\": "
+        << queries.size() * 1e9 / scalar_ns
+        << ", \"batch_qps\": " << queries.size() * 1e9 / batch_ns
+        << ", \"batch_speedup\": " << scalar_ns / batch_ns << "},\n";
+  out << "  \"peak_rss_kb\": " << PeakRssKb() << ",\n"
+      << "  \"checksum\": " << checksum << "\n"
+      << "}" << std::endl;
+  return 0;
+}
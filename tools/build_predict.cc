@@ -2,31 +2,193 @@
 // Copyright RIME Developers
 //
 #include <algorithm>
+#include <filesystem>
 #include <iostream>
+#include <boost/algorithm/string.hpp>
 #include <rime/common.h>
+#include "ngram_counts.h"
 #include "predict_db.h"
 
 using namespace rime;
 
-int main(int argc, char* argv[]) {
+// parses a line of context words separated by space, text, weight and
+// an optional filter code separated by tab.
+static bool ParseLine(const string& line,
+                      string* key,
+                      predict::RawEntry* entry) {
+  vector<string> fields;
+  boost::split(fields, line, boost::is_any_of("\t"));
+  if (fields.size() < 3 || fields[0].empty()) {
+    if (!boost::trim_copy(line).empty())
+      LOG(WARNING) << "invalid line: " << line;
+    return false;
+  }
+  *key = predict::ContextKey(fields[0]);
+  entry->text = std::move(fields[1]);
+  entry->weight = std::strtod(fields[2].c_str(), nullptr);
+  entry->code = fields.size() > 3 ? std::move(fields[3]) : string();
+  return true;
+}
+
+static bool Build(PredictDb* db) {
   rime::predict::RawData data;
-  while (std::cin) {
-    string key;
-    std::cin >> key;
-    if (key.empty())
-      break;
-    rime::predict::RawEntry entry;
-    std::cin >> entry.text >> entry.weight;
-    data[key].push_back(std::move(entry));
+  string line;
+  string key;
+  rime::predict::RawEntry entry;
+  while (std::getline(std::cin, line)) {
+    if (ParseLine(line, &key, &entry))
+      data[key].push_back(std::move(entry));
   }
+  return db->Build(data);
+}
 
-  path file_path = argc > 1 ? path(argv[1]) : path{"predict.db"};
-  PredictDb db(file_path);
+// input is grouped by key in ascending order, so that only the candidates
+// of the current key are kept in memory.
+static bool BuildSorted(PredictDb* db) {
+  if (!db->BeginBuild())
+    return false;
+  string line;
+  string key;
+  string current_key;
+  vector<rime::predict::RawEntry> candidates;
+  rime::predict::RawEntry entry;
+  while (std::getline(std::cin, line)) {
+    if (!ParseLine(line, &key, &entry))
+      continue;
+    if (key != current_key) {
+      if (!db->AddKey(current_key, candidates))
+        return false;
+      candidates.clear();
+      current_key = key;
+    }
+    candidates.push_back(std::move(entry));
+  }
+  return db->AddKey(current_key, candidates) && db->EndBuild();
+}
+
+// reads lines in the input format prefixed with + to add or reweight a
+// candidate, or - to remove one, in which case the weight is optional.
+static bool BuildDelta(PredictDb* db, const path& base_path) {
+  PredictDb base(base_path);
+  if (!base.Load())
+    return false;
+  predict::Patch patch;
+  string line;
+  string key;
+  rime::predict::RawEntry entry;
+  while (std::getline(std::cin, line)) {
+    if (line.empty())
+      continue;
+    if (line[0] == '+') {
+      if (ParseLine(line.substr(1), &key, &entry))
+        patch.added[key].push_back(std::move(entry));
+      continue;
+    }
+    vector<string> fields;
+    boost::split(fields, line, boost::is_any_of("\t"));
+    if (line[0] != '-' || fields.size() < 2 || fields[0].length() < 2) {
+      LOG(WARNING) << "invalid line: " << line;
+      continue;
+    }
+    key = predict::ContextKey(fields[0].substr(1));
+    patch.removed[key].insert(fields[1]);
+  }
+  return db->BuildDelta(&base, patch);
+}
+
+static bool BuildFromCounts(PredictDb* db,
+                            const vector<path>& files,
+                            const predict::CountOptions& options) {
+  return db->BeginBuild() &&
+         predict::AggregateCounts(
+             files, options,
+             [db](const string& key,
+                  const vector<rime::predict::RawEntry>& candidates) {
+               return db->AddKey(key, candidates);
+             }) &&
+         db->EndBuild();
+}
+
+int main(int argc, char* argv[]) {
+  bool sorted = false;
+  bool counts = false;
+  bool compact = false;
+  bool quantize_weights = false;
+  bool hot_first = false;
+  uint32_t filter_length = 0;
+  predict::KeyIndexType key_index = predict::KeyIndexType::kDarts;
+  predict::CountOptions count_options;
+  path file_path{"predict.db"};
+  path base_path;
+  vector<path> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    auto value = [&arg]() { return arg.substr(arg.find('=') + 1); };
+    if (arg == "--sorted") {
+      sorted = true;
+    } else if (arg == "--counts") {
+      counts = true;
+    } else if (arg == "--compact") {
+      compact = true;
+    } else if (arg == "--hot-first") {
+      hot_first = true;
+    } else if (arg == "--quantize-weights") {
+      compact = quantize_weights = true;
+    } else if (boost::starts_with(arg, "--filter-weight=")) {
+      count_options.filter_weight = std::stoul(value());
+    } else if (boost::starts_with(arg, "--max-candidates=")) {
+      count_options.max_candidates = std::stoul(value());
+    } else if (boost::starts_with(arg, "--filter-length=")) {
+      filter_length = std::stoul(value());
+    } else if (arg == "--key-index=marisa") {
+      key_index = predict::KeyIndexType::kMarisa;
+    } else if (arg == "--key-index=darts") {
+      key_index = predict::KeyIndexType::kDarts;
+    } else if (boost::starts_with(arg, "--threads=")) {
+      count_options.num_threads = std::stoi(value());
+    } else if (boost::starts_with(arg, "--base=")) {
+      base_path = path(value());
+    } else if (boost::starts_with(arg, "--output=")) {
+      file_path = path(value());
+    } else {
+      args.push_back(path(arg));
+    }
+  }
+  if (!counts && !args.empty())
+    file_path = args.front();
+  // built aside and then renamed, so that running sessions can keep the
+  // mapping of the old file and reload the new one
+  PredictDb db(path(file_path.string() + ".tmp"));
+  db.set_candidate_limit(count_options.max_candidates);
+  db.set_compact(compact);
+  db.set_quantized_weights(quantize_weights);
+  db.set_filter_length(filter_length);
+  db.set_hot_first(hot_first);
+  db.set_key_index_type(key_index);
   LOG(INFO) << "creating " << db.file_path();
-  if (!db.Build(data) || !db.Save()) {
+  bool built = false;
+  if (!base_path.empty())
+    built = BuildDelta(&db, base_path);
+  else if (counts)
+    built = BuildFromCounts(&db, args, count_options);
+  else if (sorted)
+    built = BuildSorted(&db);
+  else
+    built = Build(&db);
+  if (!built || !db.Save()) {
     LOG(ERROR) << "failed to build " << db.file_path();
     return 1;
   }
-  LOG(INFO) << "created: " << db.file_path();
+  db.Close();
+  std::error_code ec;
+  std::filesystem::rename(db.file_path(), file_path, ec);
+  if (ec) {
+    // on Windows, a file mapped by running sessions cannot be replaced
+    LOG(ERROR) << "failed to rename " << db.file_path() << " to " << file_path
+               << ": " << ec.message()
+               << "; if it is in use, move it in place once released.";
+    return 1;
+  }
+  LOG(INFO) << "created: " << file_path;
   return 0;
 }
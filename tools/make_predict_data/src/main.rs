@@ -58,12 +58,14 @@ fn main() -> Result<()> {
                 let key = &values[0];
                 debug!("key = {:?}", key);
                 if key.contains(' ') {
+                    // bigram or trigram: context words followed by the text.
                     let ngram = key.split(' ').collect::<Vec<&str>>();
-                    assert!(ngram.len() == 2);
-                    if ngram[1] == "$" {
+                    assert!(ngram.len() == 2 || ngram.len() == 3);
+                    let (context, value) = ngram.split_at(ngram.len() - 1);
+                    if value[0] == "$" {
                         continue;
                     }
-                    add_record(&mut data, ngram[0], ngram[1], weight);
+                    add_record(&mut data, &context.join(" "), value[0], weight);
                 } else {
                     let chars = key.chars().collect::<Vec<_>>();
                     for i in 1..chars.len() {
@@ -0,0 +1,236 @@
+//
+// Copyright RIME Developers
+//
+#include "ngram_counts.h"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <queue>
+#include <thread>
+#include <boost/algorithm/string.hpp>
+
+namespace rime {
+
+namespace predict {
+
+namespace {
+
+struct Chunk {
+  path file_path;
+  std::streamoff begin;
+  std::streamoff end;
+};
+
+struct Record {
+  string text;
+  uint32_t weight;
+  uint64_t seq;  // order of first appearance in the input
+};
+
+// records of a chunk, sorted by key.
+using Run = map<string, vector<Record>>;
+
+const int kSeqShift = 40;
+
+// splits files into chunks of whole lines, several per thread.
+bool SplitChunks(const vector<path>& files,
+                 size_t chunks_per_file,
+                 vector<Chunk>* chunks) {
+  for (const auto& file_path : files) {
+    std::ifstream in(file_path.string(), std::ios::binary);
+    if (!in) {
+      LOG(ERROR) << "error opening file " << file_path;
+      return false;
+    }
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    std::streamoff begin = 0;
+    for (size_t i = 1; i <= chunks_per_file && begin < size; ++i) {
+      std::streamoff end = size;
+      if (i < chunks_per_file) {
+        in.seekg(size / chunks_per_file * i);
+        string rest;
+        std::getline(in, rest);
+        end = in ? std::streamoff(in.tellg()) : size;
+        in.clear();
+      }
+      if (end > begin) {
+        chunks->push_back({file_path, begin, end});
+        begin = end;
+      }
+    }
+  }
+  return true;
+}
+
+void AddRecord(Run* run, const string& key, string text, uint32_t weight,
+               uint64_t seq) {
+  (*run)[key].push_back({std::move(text), weight, seq});
+}
+
+void ParseLine(const string& line,
+               const CountOptions& options,
+               uint64_t seq,
+               Run* run) {
+  vector<string> values;
+  boost::split(values, line, boost::is_any_of("\t"));
+  if (values.size() != 2 || values[0].empty()) {
+    if (!boost::trim_copy(line).empty())
+      LOG(WARNING) << "invalid line: " << line;
+    return;
+  }
+  char* end = nullptr;
+  uint32_t weight = uint32_t(std::strtoul(values[1].c_str(), &end, 10));
+  if (end == values[1].c_str()) {
+    LOG(WARNING) << "invalid count: " << line;
+    return;
+  }
+  if (weight < options.filter_weight)
+    return;
+  const string& key = values[0];
+  if (key.find(' ') != string::npos) {
+    vector<string> ngram;
+    boost::split(ngram, key, boost::is_any_of(" "));
+    if (ngram.size() != 2 && ngram.size() != 3) {
+      LOG(WARNING) << "unsupported n-gram: " << key;
+      return;
+    }
+    if (ngram.back() == "$")
+      return;
+    string text = std::move(ngram.back());
+    ngram.pop_back();
+    AddRecord(run, ContextKey(boost::join(ngram, " ")), std::move(text),
+              weight, seq);
+  } else {
+    // split at every UTF-8 character boundary
+    for (size_t i = 1; i < key.length(); ++i) {
+      if ((static_cast<unsigned char>(key[i]) & 0xc0) == 0x80)
+        continue;
+      AddRecord(run, key.substr(0, i), key.substr(i), weight, seq);
+    }
+  }
+}
+
+bool ReadChunk(const Chunk& chunk,
+               const CountOptions& options,
+               uint64_t chunk_index,
+               Run* run) {
+  std::ifstream in(chunk.file_path.string(), std::ios::binary);
+  if (!in) {
+    LOG(ERROR) << "error opening file " << chunk.file_path;
+    return false;
+  }
+  in.seekg(chunk.begin);
+  std::streamoff pos = chunk.begin;
+  uint64_t seq = chunk_index << kSeqShift;
+  string line;
+  while (pos < chunk.end && std::getline(in, line)) {
+    pos += std::streamoff(line.length()) + 1;
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    ParseLine(line, options, seq++, run);
+  }
+  return true;
+}
+
+// keeps the highest weight of each text at its first appearance, then
+// orders by weight, as make_predict_data does.
+vector<RawEntry> Finalize(vector<Record>* records, size_t max_candidates) {
+  std::sort(records->begin(), records->end(),
+            [](const Record& a, const Record& b) {
+              return a.text < b.text || (a.text == b.text && a.seq < b.seq);
+            });
+  auto last = records->begin();
+  for (auto it = records->begin(); it != records->end(); ++it) {
+    if (it != records->begin() && it->text == (last - 1)->text) {
+      (last - 1)->weight = (std::max)((last - 1)->weight, it->weight);
+    } else {
+      if (last != it)
+        *last = std::move(*it);
+      ++last;
+    }
+  }
+  records->erase(last, records->end());
+  std::sort(records->begin(), records->end(),
+            [](const Record& a, const Record& b) {
+              return a.weight > b.weight ||
+                     (a.weight == b.weight && a.seq < b.seq);
+            });
+  if (max_candidates > 0 && records->size() > max_candidates)
+    records->resize(max_candidates);
+  vector<RawEntry> candidates;
+  candidates.reserve(records->size());
+  for (auto& record : *records) {
+    candidates.push_back({std::move(record.text), double(record.weight)});
+  }
+  return candidates;
+}
+
+// k-way merge of the sorted runs, one key at a time.
+bool MergeRuns(vector<Run>* runs,
+               const CountOptions& options,
+               const CountSink& sink) {
+  using Cursor = pair<Run::iterator, size_t>;  // position, run index
+  auto greater = [](const Cursor& a, const Cursor& b) {
+    return b.first->first < a.first->first ||
+           (a.first->first == b.first->first && b.second < a.second);
+  };
+  std::priority_queue<Cursor, vector<Cursor>, decltype(greater)> heap(greater);
+  for (size_t i = 0; i < runs->size(); ++i) {
+    if (!(*runs)[i].empty())
+      heap.push({(*runs)[i].begin(), i});
+  }
+  while (!heap.empty()) {
+    string key = heap.top().first->first;
+    vector<Record> records;
+    while (!heap.empty() && heap.top().first->first == key) {
+      Cursor cursor = heap.top();
+      heap.pop();
+      auto& from = cursor.first->second;
+      std::move(from.begin(), from.end(), std::back_inserter(records));
+      vector<Record>().swap(from);
+      if (++cursor.first != (*runs)[cursor.second].end())
+        heap.push(cursor);
+    }
+    if (!sink(key, Finalize(&records, options.max_candidates)))
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool AggregateCounts(const vector<path>& files,
+                     const CountOptions& options,
+                     const CountSink& sink) {
+  size_t num_threads = options.num_threads > 0
+                           ? size_t(options.num_threads)
+                           : size_t(std::thread::hardware_concurrency());
+  num_threads = (std::max)(num_threads, size_t(1));
+  vector<Chunk> chunks;
+  if (!SplitChunks(files, num_threads * 4, &chunks))
+    return false;
+  LOG(INFO) << "reading " << chunks.size() << " chunks with " << num_threads
+            << " threads.";
+  vector<Run> runs(chunks.size());
+  std::atomic<size_t> next_chunk{0};
+  std::atomic<bool> ok{true};
+  vector<std::thread> workers;
+  for (size_t t = 0; t < (std::min)(num_threads, chunks.size()); ++t) {
+    workers.emplace_back([&] {
+      for (size_t i = next_chunk++; i < chunks.size() && ok;
+           i = next_chunk++) {
+        if (!ReadChunk(chunks[i], options, i, &runs[i]))
+          ok = false;
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return ok && MergeRuns(&runs, options, sink);
+}
+
+}  // namespace predict
+
+}  // namespace rime
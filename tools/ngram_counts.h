@@ -0,0 +1,35 @@
+//
+// Copyright RIME Developers
+//
+#ifndef RIME_PREDICT_NGRAM_COUNTS_H_
+#define RIME_PREDICT_NGRAM_COUNTS_H_
+
+#include <rime/common.h>
+#include "predict_db.h"
+
+namespace rime {
+
+namespace predict {
+
+struct CountOptions {
+  uint32_t filter_weight = 0;  // skip n-grams counted fewer times
+  size_t max_candidates = 0;   // candidates to keep per key, 0 for all
+  int num_threads = 0;         // 0 to use all cores
+};
+
+// receives keys in ascending order, candidates sorted by weight.
+using CountSink =
+    function<bool(const string& key, const vector<RawEntry>& candidates)>;
+
+// aggregates files of "n-gram<TAB>count" lines the way make_predict_data
+// does: n-grams of two or three words predict the last word from the
+// others; a single word predicts its suffixes from each of its prefixes.
+bool AggregateCounts(const vector<path>& files,
+                     const CountOptions& options,
+                     const CountSink& sink);
+
+}  // namespace predict
+
+}  // namespace rime
+
+#endif  // RIME_PREDICT_NGRAM_COUNTS_H_
@@ -0,0 +1,141 @@
+//
+// Copyright RIME Developers
+//
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <boost/algorithm/string.hpp>
+#include <rime/common.h>
+#include "predict_batch.h"
+#include "predict_db.h"
+
+using namespace rime;
+
+using Clock = std::chrono::steady_clock;
+
+static size_t Utf8Length(const string& text) {
+  return std::count_if(text.begin(), text.end(),
+                       [](char c) { return (c & 0xc0) != 0x80; });
+}
+
+// reads lines of words separated by space; each word is predicted from up
+// to context_size words before it in the line, or from "$" at its start.
+static void ReadQueries(std::istream& in,
+                        int context_size,
+                        vector<string>* queries,
+                        vector<string>* targets) {
+  string line;
+  vector<string> words;
+  while (std::getline(in, line)) {
+    boost::trim(line);
+    if (line.empty())
+      continue;
+    boost::split(words, line, boost::is_any_of(" "),
+                 boost::token_compress_on);
+    for (size_t i = 0; i < words.size(); ++i) {
+      size_t begin = i > size_t(context_size) ? i - context_size : 0;
+      string context;
+      for (size_t j = begin; j < i; ++j) {
+        if (!context.empty())
+          context += ' ';
+        context += words[j];
+      }
+      queries->push_back(context.empty() ? "$"
+                                         : predict::ContextKey(context));
+      targets->push_back(words[i]);
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  predict::BatchOptions options;
+  int context_size = 1;
+  string output;
+  path db_path;
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    auto value = [&arg]() { return arg.substr(arg.find('=') + 1); };
+    if (boost::starts_with(arg, "--top-k=")) {
+      options.top_k = std::stoul(value());
+    } else if (boost::starts_with(arg, "--context-size=")) {
+      context_size = std::stoi(value());
+    } else if (boost::starts_with(arg, "--threads=")) {
+      options.num_threads = std::stoi(value());
+    } else if (boost::starts_with(arg, "--output=")) {
+      output = value();
+    } else if (!boost::starts_with(arg, "--")) {
+      db_path = path(arg);
+    } else {
+      db_path.clear();
+      break;
+    }
+  }
+  if (db_path.empty() || options.top_k == 0 || context_size < 1) {
+    std::cerr << "usage: predict_eval [--top-k=N] [--context-size=N] "
+                 "[--threads=N] [--output=FILE] predict.db < text"
+              << std::endl;
+    return 1;
+  }
+  options.backoff = context_size > 1;
+
+  PredictDb db(db_path);
+  if (!db.Load()) {
+    LOG(ERROR) << "failed to load " << db_path;
+    return 1;
+  }
+  vector<string> queries;
+  vector<string> targets;
+  ReadQueries(std::cin, context_size, &queries, &targets);
+
+  auto start = Clock::now();
+  auto results = predict::PredictBatch(&db, queries, options);
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // hits[k] counts targets predicted at rank k; selecting a prediction
+  // takes one keystroke in place of typing each of its characters
+  vector<size_t> hits(options.top_k);
+  size_t total_chars = 0;
+  size_t saved_chars = 0;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    size_t length = Utf8Length(targets[i]);
+    total_chars += length;
+    const auto& texts = results[i];
+    auto found = std::find(texts.begin(), texts.end(), targets[i]);
+    if (found != texts.end()) {
+      ++hits[found - texts.begin()];
+      saved_chars += length - 1;
+    }
+  }
+
+  std::ofstream file;
+  if (!output.empty()) {
+    file.open(output);
+    if (!file) {
+      LOG(ERROR) << "error opening " << output;
+      return 1;
+    }
+  }
+  std::ostream& out = output.empty() ? std::cout : file;
+  auto ratio = [](size_t a, size_t b) { return b > 0 ? double(a) / b : 0.0; };
+  out << "{\n"
+      << "  \"db\": \"" << db_path.string() << "\",\n"
+      << "  \"format_compact\": " << (db.compact() ? "true" : "false") << ",\n"
+      << "  \"context_size\": " << context_size << ",\n"
+      << "  \"predictions\": " << targets.size() << ",\n"
+      << "  \"hit_at\": {";
+  size_t cumulative = 0;
+  for (size_t k = 0; k < hits.size(); ++k) {
+    cumulative += hits[k];
+    out << (k > 0 ? ", " : "") << "\"" << k + 1
+        << "\": " << ratio(cumulative, targets.size());
+  }
+  out << "},\n"
+      << "  \"keystroke_savings\": " << ratio(saved_chars, total_chars)
+      << ",\n"
+      << "  \"seconds\": " << seconds << ",\n"
+      << "  \"queries_per_second\": "
+      << (seconds > 0 ? queries.size() / seconds : 0.0) << "\n"
+      << "}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,252 @@
+//
+// Copyright RIME Developers
+//
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <boost/algorithm/string.hpp>
+#include <rime/common.h>
+#include "predict_db.h"
+
+using namespace rime;
+
+// converts a db key back to the space separated context it is built from.
+static string NgramContext(const string& key) {
+  vector<string> words;
+  boost::split(words, key,
+               [](char c) { return c == predict::kContextDelimiter; });
+  std::reverse(words.begin(), words.end());
+  return boost::join(words, " ");
+}
+
+struct DecodedCandidate {
+  string text;
+  float weight;
+  string code;  // as recovered from the filter index, if any
+};
+
+static vector<DecodedCandidate> Decode(
+    PredictDb* db,
+    const predict::CandidateList& candidates,
+    const map<string, string>& codes,
+    marisa::Agent* agent) {
+  vector<DecodedCandidate> result;
+  result.reserve(candidates.size());
+  for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+    auto text = db->GetText(it.string_id(), agent);
+    DecodedCandidate candidate{string(text.data(), text.size()), it.weight()};
+    auto code = codes.find(candidate.text);
+    if (code != codes.end())
+      candidate.code = code->second;
+    result.push_back(std::move(candidate));
+  }
+  return result;
+}
+
+// decodes the candidates of the current key of it, with their codes.
+static vector<DecodedCandidate> Decode(PredictDb* db,
+                                       const PredictDb::KeyIterator& it,
+                                       PredictDb::CodeReader* code_reader,
+                                       marisa::Agent* agent) {
+  code_reader->Seek(it.key());
+  return Decode(db, it.candidates(), code_reader->Codes(), agent);
+}
+
+// prints candidates in the input format of build_predict, with codes for
+// dbs with a filter index.
+static void Print(const string& sign,
+                  const string& key,
+                  const vector<DecodedCandidate>& candidates) {
+  string context = NgramContext(key);
+  for (const auto& candidate : candidates) {
+    std::cout << sign << context << '\t' << candidate.text << '\t'
+              << candidate.weight;
+    if (!candidate.code.empty())
+      std::cout << '\t' << candidate.code;
+    std::cout << '\n';
+  }
+}
+
+static bool Open(PredictDb* db) {
+  if (!db->Load()) {
+    std::cerr << "failed to load " << db->file_path() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static int Stats(PredictDb* db) {
+  const auto* metadata = db->metadata();
+  size_t num_keys = 0;
+  size_t num_candidates = 0;
+  size_t max_fan_out = 0;
+  // fan_out[i] counts keys of [2^i, 2^(i+1)) candidates
+  vector<size_t> fan_out;
+  for (PredictDb::KeyIterator it(db); it.Next();) {
+    size_t size = it.candidates().size();
+    ++num_keys;
+    num_candidates += size;
+    max_fan_out = (std::max)(max_fan_out, size);
+    size_t bucket = 0;
+    while (size >> (bucket + 1))
+      ++bucket;
+    if (fan_out.size() <= bucket)
+      fan_out.resize(bucket + 1);
+    ++fan_out[bucket];
+  }
+  size_t num_filter_keys = 0;
+  for (PredictDb::KeyIterator it(db, true); it.Next();) {
+    ++num_filter_keys;
+  }
+  size_t candidates_size = db->candidates_size();
+  size_t text_ids_size =
+      db->compact() ? metadata->num_texts * sizeof(StringId) : 0;
+  bool marisa = db->key_index_type() == predict::KeyIndexType::kMarisa;
+  size_t unit_size = db->key_index_unit_size();
+  size_t key_trie_size = metadata->key_trie_size * unit_size;
+  size_t filter_trie_size =
+      db->filter_length() > 0 ? metadata->filter_trie_size * unit_size : 0;
+  std::cout << "format: " << metadata->format << '\n'
+            << "checksum: " << std::hex << db->checksum() << std::dec
+            << (db->VerifyChecksum() ? " (verified)" : " (mismatch)") << '\n'
+            << "file size: " << db->file_size() << '\n'
+            << "key index: " << (marisa ? "marisa" : "darts") << '\n'
+            << "keys: " << num_keys << '\n'
+            << "candidates: " << num_candidates << '\n'
+            << "texts: " << db->num_texts() << '\n'
+            << "max candidates per key: " << max_fan_out << '\n'
+            << "filter keys: " << num_filter_keys << '\n'
+            << "section sizes:\n"
+            << "  candidates: " << candidates_size;
+  if (num_candidates > 0)
+    std::cout << " (" << double(candidates_size) / num_candidates
+              << " bytes per candidate)";
+  std::cout << '\n'
+            << "  text ids: " << text_ids_size << '\n'
+            << "  key trie: " << key_trie_size << '\n'
+            << "  filter index: " << filter_trie_size << '\n'
+            << "  string table: " << metadata->value_trie_size << '\n'
+            << "fan-out histogram:\n";
+  for (size_t i = 0; i < fan_out.size(); ++i) {
+    std::cout << "  " << (size_t(1) << i) << "-" << (size_t(2) << i) - 1
+              << ": " << fan_out[i] << '\n';
+  }
+  return 0;
+}
+
+static int Dump(PredictDb* db) {
+  marisa::Agent agent;
+  PredictDb::CodeReader code_reader(db);
+  for (PredictDb::KeyIterator it(db); it.Next();) {
+    Print("", it.key(), Decode(db, it, &code_reader, &agent));
+  }
+  return 0;
+}
+
+static int Get(PredictDb* db, const string& context) {
+  string key = predict::ContextKey(context);
+  auto candidates = db->Lookup(key);
+  if (candidates.empty()) {
+    std::cerr << "not found: " << context << std::endl;
+    return 1;
+  }
+  marisa::Agent agent;
+  Print("", key, Decode(db, candidates, {}, &agent));
+  return 0;
+}
+
+// merges the sorted keys of both dbs, printing what differs in the manner
+// of diff; weights are compared only if asked to, and codes if both dbs
+// have a filter index.
+static int Diff(PredictDb* a, PredictDb* b, bool compare_weights) {
+  PredictDb::KeyIterator it_a(a);
+  PredictDb::KeyIterator it_b(b);
+  bool has_a = it_a.Next();
+  bool has_b = it_b.Next();
+  PredictDb::CodeReader codes_a(a);
+  PredictDb::CodeReader codes_b(b);
+  bool compare_codes = a->filter_length() > 0 && b->filter_length() > 0;
+  marisa::Agent agent;
+  size_t num_differences = 0;
+  while (has_a || has_b) {
+    int order = 0;
+    if (!has_a)
+      order = 1;
+    else if (!has_b)
+      order = -1;
+    else
+      order = it_a.key().compare(it_b.key());
+    if (order < 0) {
+      Print("-", it_a.key(), Decode(a, it_a, &codes_a, &agent));
+      ++num_differences;
+      has_a = it_a.Next();
+      continue;
+    }
+    if (order > 0) {
+      Print("+", it_b.key(), Decode(b, it_b, &codes_b, &agent));
+      ++num_differences;
+      has_b = it_b.Next();
+      continue;
+    }
+    auto candidates_a = Decode(a, it_a, &codes_a, &agent);
+    auto candidates_b = Decode(b, it_b, &codes_b, &agent);
+    auto same_candidate = [=](const DecodedCandidate& x,
+                              const DecodedCandidate& y) {
+      return x.text == y.text && (!compare_weights || x.weight == y.weight) &&
+             (!compare_codes || x.code == y.code);
+    };
+    bool same = std::equal(candidates_a.begin(), candidates_a.end(),
+                           candidates_b.begin(), candidates_b.end(),
+                           same_candidate);
+    if (!same) {
+      Print("-", it_a.key(), candidates_a);
+      Print("+", it_b.key(), candidates_b);
+      ++num_differences;
+    }
+    has_a = it_a.Next();
+    has_b = it_b.Next();
+  }
+  std::cout.flush();
+  if (num_differences > 0) {
+    std::cerr << num_differences << " keys differ." << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+static int Usage() {
+  std::cerr << "usage: predict_tool stats DB\n"
+               "       predict_tool dump DB\n"
+               "       predict_tool get DB CONTEXT\n"
+               "       predict_tool diff [--weights] DB DB"
+            << std::endl;
+  return 2;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3)
+    return Usage();
+  string command(argv[1]);
+  vector<string> args(argv + 2, argv + argc);
+  bool compare_weights = false;
+  if (command == "diff" && !args.empty() && args.front() == "--weights") {
+    compare_weights = true;
+    args.erase(args.begin());
+  }
+  if (args.empty())
+    return Usage();
+  // weights round trip through dump and diff output
+  std::cout.precision(std::numeric_limits<float>::max_digits10);
+  PredictDb db{path(args[0])};
+  if (command == "stats" && args.size() == 1) {
+    return Open(&db) ? Stats(&db) : 1;
+  } else if (command == "dump" && args.size() == 1) {
+    return Open(&db) ? Dump(&db) : 1;
+  } else if (command == "get" && args.size() == 2) {
+    return Open(&db) ? Get(&db, args[1]) : 1;
+  } else if (command == "diff" && args.size() == 2) {
+    PredictDb other{path(args[1])};
+    return Open(&db) && Open(&other) ? Diff(&db, &other, compare_weights) : 1;
+  }
+  return Usage();
+}